@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# bench.sh - Load-tests the proxy: starts tiny and the proxy on free
+#     ports and drives a fixed request rate through the proxy with
+#     loadgen, reporting throughput and latency percentiles.
+#
+#     usage: ./bench.sh [rate, 0 for closed-loop] [seconds] [connections] [keepalive]
+#     e.g.   ./bench.sh 2000 10 1000
+#
+
+RATE=${1:-1000}
+DURATION=${2:-10}
+CONNS=${3:-1000}
+KEEPALIVE=${4:-0}
+
+HOME_DIR=`pwd`
+PORT_START=1024
+PORT_MAX=65000
+MAX_RAND=63000
+MAX_PORT_TRIES=10
+
+# Files fetched round-robin, from small to large
+URL_LIST="home.html
+          godzilla.gif
+          csapp.c"
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Gives up after MAX_PORT_TRIES.
+#
+function wait_for_port_use() {
+    tries="0"
+    until netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+        | grep tcp | awk '{print $4}' | sed 's/.*://' \
+        | grep -wq "${1}"
+    do
+        tries=`expr ${tries} + 1`
+        if [ "${tries}" == "${MAX_PORT_TRIES}" ]; then
+            echo "Error: nothing listening on port ${1}"
+            cleanup
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+function cleanup {
+    kill $proxy_pid $tiny_pid 2> /dev/null
+    wait $proxy_pid $tiny_pid 2> /dev/null
+}
+
+if [ ! -x ./proxy -o ! -x ./loadgen -o ! -x ./tiny/tiny ]; then
+    echo "Error: build proxy, loadgen and tiny first (make bench does this)"
+    exit 1
+fi
+
+tiny_port=$(free_port)
+cd ./tiny
+./tiny ${tiny_port} &> /dev/null &
+tiny_pid=$!
+cd "${HOME_DIR}"
+wait_for_port_use "${tiny_port}"
+
+proxy_port=$(free_port)
+./proxy ${proxy_port} &> /dev/null &
+proxy_pid=$!
+wait_for_port_use "${proxy_port}"
+
+urls=""
+for file in ${URL_LIST}
+do
+    urls="${urls} http://localhost:${tiny_port}/${file}"
+done
+
+if [ "${RATE}" == "0" ]; then
+    load="closed-loop, ${CONNS} in flight"
+else
+    load="${RATE} req/s"
+fi
+echo "*** Benchmark: ${load} for ${DURATION}s via proxy on ${proxy_port}, tiny on ${tiny_port}"
+flags=""
+[ "${KEEPALIVE}" != "0" ] && flags="-k"
+./loadgen -p localhost:${proxy_port} -r ${RATE} -d ${DURATION} -c ${CONNS} ${flags} ${urls}
+status=$?
+
+cleanup
+exit ${status}
@@ -1,12 +1,19 @@
 #include "cache.h"
+#include "metrics.h"
 
 // Recommended max cache and object sizes
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 
 
+/* number of valid objects, the ring holds at most n */
+static int cache_count(cache_t *sp){
+    int count = sp->rear - sp->front;
+    return count < sp->n ? count : sp->n;
+}
+
 void cache_init(cache_t *sp, int n){
-    sp->buf = calloc(n, sizeof(cache_object_t*));
+    sp->buf = calloc(n, sizeof(cache_object_t *));
     sp->n = n;                  /* Buffer holds max of n items */
     sp->size = 0;               /* current size of all data in cache */
     sp->front = sp->rear = 0;   /* Empty buffer iff front == rear */
@@ -15,30 +22,54 @@ void cache_init(cache_t *sp, int n){
 }
 
 void cache_deinit(cache_t *sp) {
+    while(cache_count(sp) > 0){
+        cache_release(sp->buf[(++sp->front) % (sp->n)]);
+    }
     free(sp->buf);
 }
 
-void cache_insert(cache_t *sp, cache_object_t object){
-    if(object.size > MAX_OBJECT_SIZE){
-        return;
-    }
-    if(object.size + sp->size > MAX_CACHE_SIZE) {
+/* cache object, taking a reference of the cache's own; the caller keeps its */
+void cache_insert(cache_t *sp, cache_object_t *object){
+    if(object->size > MAX_OBJECT_SIZE){
         return;
     }
+    __sync_fetch_and_add(&object->refs, 1);
     sem_wait(&sp->rw);                        /* Lock the buffer */
+    /* Evict the oldest objects until the new one fits.  Each is freed
+       once the last thread sending it lets go. */
+    while(cache_count(sp) > 0 &&
+          (cache_count(sp) == sp->n || object->size + sp->size > MAX_CACHE_SIZE)){
+        cache_object_t *evicted = sp->buf[(++sp->front) % (sp->n)];
+        sp->size -= evicted->size;
+        cache_release(evicted);
+        metrics_inc(M_CACHE_EVICTIONS, 1);
+    }
     sp->buf[(++sp->rear) % (sp->n)] = object; /* Insert the item */
-    sp->size += object.size;                  /* update cache size */
+    sp->size += object->size;                 /* update cache size */
     sem_post(&sp->rw);                        /* Unlock the buffer */
 }
 
-cache_object_t cache_build_object(int size, char *url, char *content){
-    cache_object_t object;
-    object.size = size;
-    object.url = url;
-    object.content = content;
+/* new object owning url and content, with one reference for the caller */
+cache_object_t *cache_build_object(int size, char *url, char *content){
+    cache_object_t *object = malloc(sizeof(cache_object_t));
+    object->size = size;
+    object->url = url;
+    object->content = content;
+    object->refs = 1;
     return object;
 }
 
+/* drop a reference; the last one frees the object */
+void cache_release(cache_object_t *object){
+    if(__sync_sub_and_fetch(&object->refs, 1) == 0){
+        free(object->url);
+        free(object->content);
+        free(object);
+    }
+}
+
+/* newest object for url with a reference for the caller, who must
+   cache_release it; NULL if none */
 cache_object_t *cache_find_object(cache_t *sp, char *url){
     static int readers = 0;
     cache_object_t *object = NULL;
@@ -50,15 +81,20 @@ cache_object_t *cache_find_object(cache_t *sp, char *url){
     }
     sem_post(&sp->mutex);
 
-    int index = sp->front;
-    while(index != sp->rear){
-        if(strcmp(sp->buf[index].url, url) == 0){
-            object = &(sp->buf[index]);
+    /* the reference is taken under the readers' lock, so the object
+       can't be evicted and freed before the caller has it */
+    int count = cache_count(sp);
+    for(int i = 0; i < count; i++){
+        int index = (sp->rear - i) % (sp->n); /* newest first */
+        if(strcmp(sp->buf[index]->url, url) == 0){
+            object = sp->buf[index];
+            __sync_fetch_and_add(&object->refs, 1);
             break;
         }
-        index = (index + 1) % (sp->n);
     }
     
+    metrics_inc(object ? M_CACHE_HITS : M_CACHE_MISSES, 1);
+
     sem_wait(&sp->mutex);
     readers--;
     if(readers == 0){
@@ -67,4 +103,18 @@ cache_object_t *cache_find_object(cache_t *sp, char *url){
     sem_post(&sp->mutex);
 
     return object;
-}
\ No newline at end of file
+}
+/* call fn on every cached object, oldest first, while holding the writer lock */
+void cache_foreach(cache_t *sp, void (*fn)(cache_object_t *object, void *arg), void *arg){
+    sem_wait(&sp->rw);
+    int count = cache_count(sp);
+    for(int i = count - 1; i >= 0; i--){
+        fn(sp->buf[(sp->rear - i) % (sp->n)], arg);
+    }
+    sem_post(&sp->rw);
+}
+
+/* number of cached objects, for reporting; not locked */
+int cache_objects(cache_t *sp){
+    return cache_count(sp);
+}
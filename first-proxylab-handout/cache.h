@@ -11,10 +11,11 @@ typedef struct{
     int size;
     char *url;
     char *content;
+    int refs;    /* The cache's reference, if cached, plus every user's */
 } cache_object_t;
 
 typedef struct{
-    cache_object_t *buf;    /* Buffer array */
+    cache_object_t **buf;   /* Buffer array */
     int n;       /* Maximum number of slots */
     int size;    /* Maximum total size of all content in cache */
     int front;   /* buf[(front+1)%n] is first item */
@@ -25,9 +26,12 @@ typedef struct{
 
 void cache_init(cache_t *sp, int n);
 void cache_deinit(cache_t *sp);
-void cache_insert(cache_t *sp, cache_object_t object);
-cache_object_t cache_build_object(int size, char* url, char* content);
+void cache_insert(cache_t *sp, cache_object_t *object);
+cache_object_t *cache_build_object(int size, char* url, char* content);
 cache_object_t *cache_find_object(cache_t *sp, char* url);
+void cache_release(cache_object_t *object);
+int cache_objects(cache_t *sp);
+void cache_foreach(cache_t *sp, void (*fn)(cache_object_t *object, void *arg), void *arg);
 
 // cache_object_t cache_remove(cache_object_t *sp); // not needed for lab
 
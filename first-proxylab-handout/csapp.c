@@ -783,18 +783,13 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 
 
 /* 
- * rio_read - This is a wrapper for the Unix read() function that
- *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
- *    buffer, where n is the number of bytes requested by the user and
- *    rio_cnt is the number of unread bytes in the internal buffer. On
- *    entry, rio_read() refills the internal buffer via a call to
- *    read() if the internal buffer is empty.
+ * rio_fill - Refill the internal buffer via a call to read() if it is
+ *    empty.  Returns the number of unread bytes in it, 0 on EOF or -1
+ *    on error.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+/* $begin rio_fill */
+static ssize_t rio_fill(rio_t *rp)
 {
-    int cnt;
-
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
 	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
 			   sizeof(rp->rio_buf));
@@ -807,6 +802,26 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 	else 
 	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
     }
+    return rp->rio_cnt;
+}
+/* $end rio_fill */
+
+/* 
+ * rio_read - This is a wrapper for the Unix read() function that
+ *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
+ *    buffer, where n is the number of bytes requested by the user and
+ *    rio_cnt is the number of unread bytes in the internal buffer. On
+ *    entry, rio_read() refills the internal buffer via a call to
+ *    read() if the internal buffer is empty.
+ */
+/* $begin rio_read */
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -854,34 +869,164 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered).  Rather than
+ *    going through rio_read a byte at a time, memchr() looks for the
+ *    newline in the internal buffer and whole spans are copied at once.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    while (n + 1 < maxlen && nl == NULL) {
+	if ((rc = rio_fill(rp)) < 0)
+	    return -1;    /* Error */
+	else if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+	/* Up to and including the newline, if it is in the buffer */
+	cnt = rp->rio_cnt;
+	if (cnt > maxlen - 1 - n)
+	    cnt = maxlen - 1 - n;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	bufp += cnt;
+	n += cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_viewinit - Associate a descriptor with a view buffer of bufsize
+ *    bytes (RIO_BUFSIZE if 0).  Free it with rio_viewfree.
+ */
+/* $begin rio_viewinit */
+void rio_viewinit(riov_t *rp, int fd, size_t bufsize) 
+{
+    rp->rio_fd = fd;
+    rp->rio_size = bufsize ? bufsize : RIO_BUFSIZE;
+    rp->rio_buf = Malloc(rp->rio_size);
+    rp->rio_start = rp->rio_end = rp->rio_buf;
+}
+
+void rio_viewfree(riov_t *rp) 
+{
+    Free(rp->rio_buf);
+    rp->rio_buf = rp->rio_start = rp->rio_end = NULL;
+}
+/* $end rio_viewinit */
+
+/*
+ * rio_viewmore - Read more bytes into the view buffer.  If there is no
+ *    room after the unconsumed ones, first slide them to the front, or
+ *    if they fill the whole buffer, double it (to at most limit
+ *    bytes).  Returns the number of bytes read, 0 on EOF or if the
+ *    buffer may not grow, or -1 on error.
+ */
+/* $begin rio_viewmore */
+static ssize_t rio_viewmore(riov_t *rp, size_t limit)
+{
+    size_t used = rp->rio_end - rp->rio_start, size;
+    ssize_t n;
+
+    if (rp->rio_end == rp->rio_buf + rp->rio_size) {
+	if (rp->rio_start != rp->rio_buf) {      /* Compact */
+	    memmove(rp->rio_buf, rp->rio_start, used);
+	}
+	else {                                   /* Grow */
+	    if (rp->rio_size >= limit)
+		return 0;
+	    size = rp->rio_size * 2 < limit ? rp->rio_size * 2 : limit;
+	    rp->rio_buf = Realloc(rp->rio_buf, size);
+	    rp->rio_size = size;
+	}
+	rp->rio_start = rp->rio_buf;
+	rp->rio_end = rp->rio_buf + used;
+    }
+    while ((n = read(rp->rio_fd, rp->rio_end, 
+		     rp->rio_buf + rp->rio_size - rp->rio_end)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_end += n;
+    return n;
+}
+/* $end rio_viewmore */
+
+/*
+ * rio_viewlineb - Robustly find the next text line (buffered) and set
+ *    *linep to it in place, without copying.  The line includes its
+ *    newline, is not NUL-terminated, and is cut off after maxlen (> 0)
+ *    bytes.  The view is good until the next call on rp.  Returns its
+ *    length, 0 on EOF, or -1 on error.
+ */
+/* $begin rio_viewlineb */
+ssize_t rio_viewlineb(riov_t *rp, char **linep, size_t maxlen) 
+{
+    size_t scanned = 0, len;
+    char *nl;
+    ssize_t rc;
+
+    if (rp->rio_start == rp->rio_end)  /* All consumed, start over */
+	rp->rio_start = rp->rio_end = rp->rio_buf;
+    while ((nl = memchr(rp->rio_start + scanned, '\n',
+			(rp->rio_end - rp->rio_start) - scanned)) == NULL) {
+	scanned = rp->rio_end - rp->rio_start;
+	if (scanned >= maxlen)
+	    break;
+	if ((rc = rio_viewmore(rp, maxlen)) < 0)
+	    return -1;    /* Error */
+	else if (rc == 0)
+	    break;        /* EOF */
+    }
+    len = nl ? nl - rp->rio_start + 1 : rp->rio_end - rp->rio_start;
+    if (len > maxlen)
+	len = maxlen;
+    *linep = rp->rio_start;
+    rp->rio_start += len;
+    return len;
+}
+/* $end rio_viewlineb */
+
+/*
+ * rio_viewnb - Robustly read the next n bytes (buffered) and set *datap
+ *    to them in place, without copying; the buffer grows if n is more
+ *    than it holds.  The view is good until the next call on rp.
+ *    Returns n, fewer on EOF, or -1 on error.
+ */
+/* $begin rio_viewnb */
+ssize_t rio_viewnb(riov_t *rp, char **datap, size_t n) 
+{
+    size_t len;
+    ssize_t rc;
+
+    if (rp->rio_start == rp->rio_end)  /* All consumed, start over */
+	rp->rio_start = rp->rio_end = rp->rio_buf;
+    while ((size_t)(rp->rio_end - rp->rio_start) < n) {
+	if ((rc = rio_viewmore(rp, n)) < 0)
+	    return -1;    /* Error */
+	else if (rc == 0)
+	    break;        /* EOF */
+    }
+    len = rp->rio_end - rp->rio_start;
+    if (len > n)
+	len = n;
+    *datap = rp->rio_start;
+    rp->rio_start += len;
+    return len;
+}
+/* $end rio_viewnb */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -923,6 +1068,24 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_viewlineb(riov_t *rp, char **linep, size_t maxlen) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_viewlineb(rp, linep, maxlen)) < 0)
+	unix_error("Rio_viewlineb error");
+    return rc;
+} 
+
+ssize_t Rio_viewnb(riov_t *rp, char **datap, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_viewnb(rp, datap, n)) < 0)
+	unix_error("Rio_viewnb error");
+    return rc;
+} 
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -938,7 +1101,7 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
     int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    struct addrinfo hints, *listp;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -950,33 +1113,130 @@ int open_clientfd(char *hostname, char *port) {
         return -2;
     }
   
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
-
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+    /* Race the addresses for one that we can connect to */
+    clientfd = open_clientfd_list(listp);
 
     /* Clean up */
     freeaddrinfo(listp);
-    if (!p) /* All connects failed */
-        return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    return clientfd;
 }
 /* $end open_clientfd */
 
+/*
+ * open_clientfd_list - Connect to one of the addresses in listp, "happy
+ *     eyeballs" style (RFC 8305): address families take turns, starting
+ *     with getaddrinfo's first choice, and each non-blocking connect
+ *     gets CONNECT_DELAY ms (or until it fails) before the next one is
+ *     started alongside it.  The first to succeed wins and the others
+ *     are closed, so an unreachable address (often IPv6) costs
+ *     CONNECT_DELAY rather than the kernel's connect timeout.
+ *
+ *     Returns a blocking socket descriptor, or -1 with errno set to
+ *     the last error seen if every connect failed.
+ */
+/* $begin open_clientfd_list */
+int open_clientfd_list(struct addrinfo *listp) 
+{
+    struct addrinfo *p, *first, *other, **addrs;
+    struct pollfd *pfds;
+    int naddrs = 0, next = 0, nfds = 0, i, j, fd, clientfd = -1;
+    int err = ECONNREFUSED, soerr;
+    socklen_t len;
+
+    for (p = listp; p; p = p->ai_next)
+	naddrs++;
+    if (naddrs == 0) {
+	errno = err;
+	return -1;
+    }
+    addrs = Malloc(naddrs * sizeof(*addrs));
+    pfds = Malloc(naddrs * sizeof(*pfds));
+
+    /* Interleave families: the first result's, then another, and so on */
+    first = other = listp;
+    for (i = 0; i < naddrs; ) {
+	while (first && first->ai_family != listp->ai_family)
+	    first = first->ai_next;
+	while (other && other->ai_family == listp->ai_family)
+	    other = other->ai_next;
+	if (first) {
+	    addrs[i++] = first;
+	    first = first->ai_next;
+	}
+	if (other) {
+	    addrs[i++] = other;
+	    other = other->ai_next;
+	}
+    }
+
+    while (clientfd < 0 && (next < naddrs || nfds > 0)) {
+	/* Start the next attempt */
+	if (next < naddrs) {
+	    p = addrs[next++];
+	    if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK,
+			     p->ai_protocol)) < 0) {
+		err = errno;
+		continue;  /* Socket failed, try the next */
+	    }
+	    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+		clientfd = fd;
+		break;     /* Connected at once (e.g. loopback) */
+	    }
+	    if (errno != EINPROGRESS) {
+		err = errno;
+		close(fd);
+		continue;  /* Refused outright, try the next */
+	    }
+	    pfds[nfds].fd = fd;
+	    pfds[nfds].events = POLLOUT;
+	    nfds++;
+	}
+
+	/* Wait for any attempt to finish, but only CONNECT_DELAY ms
+	   while there are addresses left to try */
+	if (poll(pfds, nfds, next < naddrs ? CONNECT_DELAY : -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    err = errno;
+	    break;
+	}
+	for (i = 0; i < nfds && clientfd < 0; i++) {
+	    if (pfds[i].revents == 0)
+		continue;
+	    len = sizeof(soerr);
+	    if (getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0)
+		soerr = errno;
+	    if (soerr == 0)
+		clientfd = pfds[i].fd;  /* Success */
+	    else {
+		err = soerr;
+		close(pfds[i].fd);      /* Failed; a new one starts next time */
+	    }
+	    for (j = i; j < nfds - 1; j++)
+		pfds[j] = pfds[j + 1];
+	    nfds--;
+	    i--;
+	}
+    }
+
+    /* Clean up the losers */
+    for (i = 0; i < nfds; i++)
+	close(pfds[i].fd);
+    Free(addrs);
+    Free(pfds);
+    if (clientfd < 0) {
+	errno = err;
+	return -1;
+    }
+    fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) & ~O_NONBLOCK);
+    return clientfd;
+}
+/* $end open_clientfd_list */
+
 /*  
- * open_listenfd - Open and return a listening socket on port. This
- *     function is reentrant and protocol-independent.
+ * open_listenfd - Open and return a listening socket on port, with
+ *     the default options from listenopts_init. This function is
+ *     reentrant and protocol-independent.
  *
  *     On error, returns: 
  *       -2 for getaddrinfo error
@@ -984,9 +1244,82 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    listenopts_t opts;
+
+    listenopts_init(&opts);
+    return open_listenfd_opts(port, &opts);
+}
+/* $end open_listenfd */
+
+/*
+ * listenopts_init - The defaults, which are what open_listenfd has
+ *     always done: a blocking socket on the first address that binds
+ *     (IPv4 on most hosts) with a LISTENQ backlog.
+ */
+void listenopts_init(listenopts_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->backlog = LISTENQ;
+}
+
+/*
+ * listenopts_parse - Update opts from a comma-separated spec such as
+ *     "backlog=4096,reuseport,defer=1,fastopen=256,dualstack,nonblock",
+ *     for servers that take their listener options on the command
+ *     line. Returns 0, or -1 (opts partly updated) on a bad spec.
+ */
+int listenopts_parse(listenopts_t *opts, char *spec)
+{
+    char buf[MAXLINE], *name, *value, *save, *end;
+    long n;
+
+    if (strlen(spec) >= sizeof(buf))
+	return -1;
+    strcpy(buf, spec);
+    for (name = strtok_r(buf, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+	n = 1;
+	if ((value = strchr(name, '=')) != NULL) {
+	    *value++ = '\0';
+	    n = strtol(value, &end, 10);
+	    if (*value == '\0' || *end != '\0' || n < 0 || n > INT_MAX)
+		return -1;
+	}
+	if (!strcmp(name, "backlog") && value && n > 0)
+	    opts->backlog = n;
+	else if (!strcmp(name, "reuseport"))
+	    opts->reuseport = n;
+	else if (!strcmp(name, "defer"))
+	    opts->defer_accept = n;
+	else if (!strcmp(name, "fastopen"))
+	    opts->fastopen = value ? n : LISTENQ;
+	else if (!strcmp(name, "dualstack"))
+	    opts->dualstack = n;
+	else if (!strcmp(name, "nonblock"))
+	    opts->nonblock = n;
+	else
+	    return -1;
+    }
+    return 0;
+}
+
+/*  
+ * open_listenfd_opts - Open and return a listening socket on port,
+ *     set up as opts asks. With dualstack, an IPv6 address is tried
+ *     first and IPV6_V6ONLY is cleared, so one socket accepts both
+ *     families; otherwise (or without IPv6) the first address that
+ *     binds is used, as before. The TCP options are best effort: a
+ *     kernel without them still gets a working listener.
+ *
+ *     On error, returns: 
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors.
+ */
+/* $begin open_listenfd_opts */
+int open_listenfd_opts(char *port, listenopts_t *opts)
 {
     struct addrinfo hints, *listp, *p;
-    int listenfd, rc, optval=1;
+    int listenfd, rc, pass, optval=1, zero=0;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -998,39 +1331,66 @@ int open_listenfd(char *port)
         return -2;
     }
 
-    /* Walk the list for one that we can bind to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue;  /* Socket failed, try the next */
-
-        /* Eliminates "Address already in use" error from bind */
-        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
-                   (const void *)&optval , sizeof(int));
-
-        /* Bind the descriptor to the address */
-        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
-            break; /* Success */
-        if (close(listenfd) < 0) { /* Bind failed, try the next */
-            fprintf(stderr, "open_listenfd close failed: %s\n", strerror(errno));
-            return -1;
-        }
+    /* Walk the list for one that we can bind to: IPv6 addresses
+       first for a dual-stack socket, then any address */
+    for (pass = opts->dualstack ? 0 : 1, p = NULL; pass < 2 && !p; pass++) {
+	for (p = listp; p; p = p->ai_next) {
+	    if (pass == 0 && p->ai_family != AF_INET6)
+		continue;
+
+	    /* Create a socket descriptor */
+	    if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
+		continue;  /* Socket failed, try the next */
+
+	    /* Eliminates "Address already in use" error from bind */
+	    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
+		       (const void *)&optval , sizeof(int));
+	    if (opts->reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+					      &optval, sizeof(int)) < 0) {
+		close(listenfd);  /* Sharing the port was asked for; no fallback */
+		continue;
+	    }
+	    if (p->ai_family == AF_INET6 && opts->dualstack)
+		setsockopt(listenfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(int));
+
+	    /* Bind the descriptor to the address */
+	    if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+		break; /* Success */
+	    if (close(listenfd) < 0) { /* Bind failed, try the next */
+		fprintf(stderr, "open_listenfd close failed: %s\n", strerror(errno));
+		freeaddrinfo(listp);
+		return -1;
+	    }
+	}
     }
 
-
     /* Clean up */
     freeaddrinfo(listp);
     if (!p) /* No address worked */
         return -1;
 
+    /* Don't wake accept for a connection until its request arrives */
+    if (opts->defer_accept)
+	setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		   &opts->defer_accept, sizeof(int));
+    /* Take data in the SYN from clients holding a Fast Open cookie */
+    if (opts->fastopen)
+	setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+		   &opts->fastopen, sizeof(int));
+    if (opts->nonblock &&
+	fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+	close(listenfd);
+	return -1;
+    }
+
     /* Make it a listening socket ready to accept connection requests */
-    if (listen(listenfd, LISTENQ) < 0) {
+    if (listen(listenfd, opts->backlog) < 0) {
         close(listenfd);
 	return -1;
     }
     return listenfd;
 }
-/* $end open_listenfd */
+/* $end open_listenfd_opts */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1053,6 +1413,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_opts(char *port, listenopts_t *opts) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opts(port, opts)) < 0)
+	unix_error("Open_listenfd_opts error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
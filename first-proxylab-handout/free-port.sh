@@ -9,8 +9,8 @@ port=${PORT_START}
 
 while [ TRUE ] 
 do
-  portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip | grep tcp | \
-    cut -c21- | cut -d':' -f2 | cut -d' ' -f1 | grep -E "[0-9]+" | uniq | tr "\n" " "`
+  portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 | grep tcp | \
+    awk '{print $4}' | sed 's/.*://' | grep -E "[0-9]+" | uniq | tr "\n" " "`
 
   echo "${portsinuse}" | grep -wq "${port}"
   if [ "$?" == "0" ]; then
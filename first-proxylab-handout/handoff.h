@@ -0,0 +1,19 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <sys/types.h>
+#include "cache.h"
+
+// Environment variable holding the Unix socket a reloaded proxy inherits
+#define HANDOFF_ENV "PROXY_HANDOFF_FD"
+
+int handoff_send_fd(int sock, int fd);
+int handoff_recv_fd(int sock);
+pid_t handoff_spawn(char **argv, int *sockp);
+int handoff_inherited_sock(void);
+int handoff_ack(int sock);
+int handoff_wait_ack(int sock);
+int handoff_send_cache(int sock, cache_t *cache);
+int handoff_recv_cache(int sock, cache_t *cache);
+
+#endif /* __HANDOFF_H__ */
@@ -0,0 +1,64 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_LINE_MAX 1024
+
+int log_level = LOG_LEVEL_INFO;
+
+static const char *level_names[] = {"error", "warn", "info", "debug"};
+
+// pick up the runtime level from the environment, if set
+void log_init(void)
+{
+    char *name = getenv(LOG_ENV);
+    if (name == NULL)
+    {
+        return;
+    }
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+        {
+            log_set_level(i);
+            return;
+        }
+    }
+    log_set_level(atoi(name));
+}
+
+void log_set_level(int level)
+{
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+// format the whole line first and emit it with one write(2), so threads
+// never share a stdio lock and lines don't interleave
+void log_write(int level, const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX];
+    va_list ap;
+    int len;
+
+    len = snprintf(line, sizeof(line), "[%s] ", level_names[level]);
+    va_start(ap, fmt);
+    len += vsnprintf(line + len, sizeof(line) - len, fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(line) - 2)
+    {
+        len = sizeof(line) - 2;
+    }
+    if (line[len - 1] != '\n')
+    {
+        line[len++] = '\n';
+    }
+    if (write(STDERR_FILENO, line, len) < 0)
+    {
+        // nowhere left to report it
+    }
+}
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+
+__thread metrics_slot_t *metrics_my_slot;
+
+static metrics_slot_t slots[METRICS_MAX_THREADS];
+static int nslots = 0;
+static metrics_extra_fn admin_extra;
+static int admin_listenfd = -1;
+
+static const char *counter_names[M_NCOUNTERS] = {
+    "proxy_connections_total",
+    "proxy_requests_total",
+    "proxy_errors_total",
+    "proxy_client_read_bytes_total",
+    "proxy_server_written_bytes_total",
+    "proxy_server_read_bytes_total",
+    "proxy_client_written_bytes_total",
+    "proxy_cache_hits_total",
+    "proxy_cache_misses_total",
+    "proxy_cache_evictions_total",
+};
+
+static const char *gauge_states[G_NGAUGES] = {
+    "read_client",
+    "write_server",
+    "read_server",
+    "write_client",
+};
+
+static const char *hist_names[H_NHISTS] = {
+    "proxy_request_duration_seconds",
+    "proxy_upstream_duration_seconds",
+};
+
+// claim a slot for the calling thread on its first update
+metrics_slot_t *metrics_register(void)
+{
+    int i = __atomic_fetch_add(&nslots, 1, __ATOMIC_RELAXED);
+    if (i >= METRICS_MAX_THREADS - 1)
+    {
+        i = METRICS_MAX_THREADS - 1;
+        slots[i].shared = 1;
+    }
+    metrics_my_slot = &slots[i];
+    return metrics_my_slot;
+}
+
+// exclusive upper bound, in usec, of histogram bucket i
+static uint64_t bucket_limit(int i)
+{
+    int k = i >> METRICS_SUB_BITS;
+    int sub = i & ((1 << METRICS_SUB_BITS) - 1);
+
+    if (k == 0)
+    {
+        return i + 1;
+    }
+    return (uint64_t)((1 << METRICS_SUB_BITS) + sub + 1) << (k - 1);
+}
+
+// render every metric in the Prometheus text format, returns the length
+int metrics_format(char *buf, int size, metrics_extra_fn extra)
+{
+    uint64_t counters[M_NCOUNTERS] = {0};
+    int64_t gauges[G_NGAUGES] = {0};
+    uint64_t hist[H_NHISTS][METRICS_NBUCKETS];
+    uint64_t hist_sum[H_NHISTS] = {0};
+    int n = __atomic_load_n(&nslots, __ATOMIC_RELAXED);
+    int len = 0;
+    int i, j, s;
+
+    if (n > METRICS_MAX_THREADS)
+    {
+        n = METRICS_MAX_THREADS;
+    }
+    memset(hist, 0, sizeof(hist));
+    for (s = 0; s < n; s++)
+    {
+        metrics_slot_t *slot = &slots[s];
+        for (i = 0; i < M_NCOUNTERS; i++)
+            counters[i] += __atomic_load_n(&slot->counters[i], __ATOMIC_RELAXED);
+        for (i = 0; i < G_NGAUGES; i++)
+            gauges[i] += __atomic_load_n(&slot->gauges[i], __ATOMIC_RELAXED);
+        for (i = 0; i < H_NHISTS; i++)
+        {
+            for (j = 0; j < METRICS_NBUCKETS; j++)
+                hist[i][j] += __atomic_load_n(&slot->hist[i][j], __ATOMIC_RELAXED);
+            hist_sum[i] += __atomic_load_n(&slot->hist_sum[i], __ATOMIC_RELAXED);
+        }
+    }
+
+#define APPEND(...)                                                   \
+    do                                                                \
+    {                                                                 \
+        if (len < size)                                               \
+            len += snprintf(buf + len, size - len, __VA_ARGS__);      \
+    } while (0)
+
+    for (i = 0; i < M_NCOUNTERS; i++)
+    {
+        APPEND("# TYPE %s counter\n%s %lu\n", counter_names[i], counter_names[i],
+               (unsigned long)counters[i]);
+    }
+    APPEND("# TYPE proxy_active_connections gauge\n");
+    for (i = 0; i < G_NGAUGES; i++)
+    {
+        APPEND("proxy_active_connections{state=\"%s\"} %ld\n", gauge_states[i], (long)gauges[i]);
+    }
+    for (i = 0; i < H_NHISTS; i++)
+    {
+        uint64_t cumulative = 0;
+        int last = -1;
+        for (j = 0; j < METRICS_NBUCKETS - 1; j++)
+        {
+            if (hist[i][j])
+                last = j;
+        }
+        APPEND("# TYPE %s histogram\n", hist_names[i]);
+        for (j = 0; j <= last; j++)
+        {
+            cumulative += hist[i][j];
+            APPEND("%s_bucket{le=\"%.6f\"} %lu\n", hist_names[i],
+                   bucket_limit(j) / 1e6, (unsigned long)cumulative);
+        }
+        for (; j < METRICS_NBUCKETS; j++)
+        {
+            cumulative += hist[i][j];
+        }
+        APPEND("%s_bucket{le=\"+Inf\"} %lu\n", hist_names[i], (unsigned long)cumulative);
+        APPEND("%s_sum %.6f\n", hist_names[i], hist_sum[i] / 1e6);
+        APPEND("%s_count %lu\n", hist_names[i], (unsigned long)cumulative);
+    }
+#undef APPEND
+
+    if (extra && len < size)
+    {
+        len += extra(buf + len, size - len);
+    }
+    return len < size ? len : size - 1;
+}
+
+static int open_admin_listenfd(char *port)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+    {
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next)
+    {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0 && listen(listenfd, 16) == 0)
+            break;
+        close(listenfd);
+        listenfd = -1;
+    }
+    freeaddrinfo(listp);
+    return listenfd;
+}
+
+// answer one scrape: read the request, send the metrics, close
+static void serve_scrape(int connfd)
+{
+    static char body[METRICS_BUFSIZE];
+    char req[4096], header[256];
+    struct timeval timeout = {1, 0};
+    int nread = 0, n, len, hlen;
+
+    setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while (nread < (int)sizeof(req) - 1 &&
+           (n = read(connfd, req + nread, sizeof(req) - 1 - nread)) > 0)
+    {
+        nread += n;
+        req[nread] = '\0';
+        if (strstr(req, "\r\n\r\n"))
+            break;
+    }
+
+    len = metrics_format(body, sizeof(body), admin_extra);
+    hlen = snprintf(header, sizeof(header),
+                    "HTTP/1.0 200 OK\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %d\r\n"
+                    "Connection: close\r\n\r\n",
+                    len);
+    if (write(connfd, header, hlen) == hlen)
+    {
+        for (n = 0; n < len;)
+        {
+            int written = write(connfd, body + n, len - n);
+            if (written <= 0)
+                break;
+            n += written;
+        }
+    }
+    close(connfd);
+}
+
+static void *admin_thread(void *vargp)
+{
+    int listenfd = (int)(long)vargp;
+    sigset_t mask;
+
+    // leave shutdown/reload signals to the proxy's main thread
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    pthread_detach(pthread_self());
+    while (1)
+    {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd >= 0)
+        {
+            serve_scrape(connfd);
+        }
+        else if (errno == EINVAL)
+        {
+            break; // metrics_admin_stop() shut the listener down
+        }
+    }
+    close(listenfd);
+    return NULL;
+}
+
+// serve /metrics (any path, really) on port from a background thread
+int metrics_admin_start(char *port, metrics_extra_fn extra)
+{
+    pthread_t tid;
+    int listenfd;
+
+    if ((listenfd = open_admin_listenfd(port)) < 0)
+    {
+        return -1;
+    }
+    admin_extra = extra;
+    if (pthread_create(&tid, NULL, admin_thread, (void *)(long)listenfd) != 0)
+    {
+        close(listenfd);
+        return -1;
+    }
+    admin_listenfd = listenfd;
+    return listenfd;
+}
+
+// release the admin port (e.g. for a reloaded process); the thread exits
+void metrics_admin_stop(void)
+{
+    if (admin_listenfd >= 0)
+    {
+        shutdown(admin_listenfd, SHUT_RDWR);
+        admin_listenfd = -1;
+    }
+}
@@ -9,10 +9,19 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/select.h>
+#include <fcntl.h>
 
+#include "csapp.h"
 #include "sbuf.h"
 #include "logbuf.h"
 #include "cache.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "log.h"
 
 // Recommended max cache and object sizes
 #define MAX_CACHE_SIZE 1049000
@@ -27,6 +36,10 @@ sbuf_t sbuf;     // shared buffer to hold the client connection file descriptors
 logbuf_t logbuf; // shared buffer to hold the URLs that will be put into the log file
 cache_t cache;   // the cache
 
+volatile sig_atomic_t shutdown_requested = 0; // SIGTERM/SIGINT: drain and exit
+volatile sig_atomic_t reload_requested = 0;   // SIGHUP/SIGUSR2: hand off listenfd
+int inflight = 0; // connections accepted but not yet served, updated atomically
+
 typedef struct
 {
     char *host;
@@ -51,20 +64,20 @@ req_info_t parse_request(char *buf)
     char *req_type = strtok(buf, " ");
     if (strcmp(req_type, "GET") != 0)
     {
-        fprintf(stderr, "Bad req_type: %s\n", req_type);
+        LOG_WARN("Bad req_type: %s", req_type);
         // TODO: discard request
     }
     char *http = strtok(NULL, "//");
     if (strcmp(http, "http:") != 0)
     {
-        fprintf(stderr, "bad http: %s\n", http);
+        LOG_WARN("bad http: %s", http);
         // TODO: discard request
     }
     char *host = strtok(NULL, "/");
     // printf("host: %s\n", host);
     if (strlen(host) == 0)
     {
-        fprintf(stderr, "bad host: %s\n", host);
+        LOG_WARN("bad host: %s", host);
         // TODO: discard request
     }
     // find if contains port
@@ -81,7 +94,7 @@ req_info_t parse_request(char *buf)
     pathEnd[0] = '\0';
     if (path == NULL)
     {
-        fprintf(stderr, "bad request, not HTTP/1.1");
+        LOG_WARN("bad request, not HTTP/1.1");
         // TODO discard request;
     }
     // printf("path: %s\n\n", path);
@@ -159,51 +172,24 @@ req_info_t parse_request(char *buf)
     return req_info;
 }
 
-cache_object_t contact_host(req_info_t req_info, char *url)
+// fetch url; the returned object has a reference for the caller to release
+cache_object_t *contact_host(req_info_t req_info, char *url)
 {
-    // Provided client code
-    struct addrinfo hints;
-    struct addrinfo *result;
-    struct addrinfo *rp;
     int hostfd;
-    /* Obtain address(es) matching host/port */
-    printf("size of url: %ld, url: %s\n", strlen(url), url);
-    // memset(&hints, 0, sizeof(struct addrinfo));
-    printf("size of url: %ld, url: %s\n", strlen(url), url);
-    hints.ai_family = AF_UNSPEC;     /* Allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_STREAM; /* TCP socket */
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0; /* Any protocol */
-    //host and port come from the original http GET request
-    int s = getaddrinfo(req_info.host, req_info.port ? req_info.port : "80", &hints, &result);
-    if (s != 0)
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
-    }
-    printf("url: %s\n", url);
-    // Breaks before here
-    /* getaddrinfo() returns a list of address structures.
-    Try each address until we successfully connect(2).
-    If socket(2) (or connect(2)) fails, we (close the socket
-    and) try the next address. */
-    for (rp = result; rp != NULL; rp = rp->ai_next)
+    uint64_t upstream_start = metrics_now_usec();
+    LOG_DEBUG("contact_host: %s", url);
+    // open_clientfd races the host's addresses (happy eyeballs), so one
+    // dead address costs CONNECT_DELAY ms rather than a full TCP timeout
+    hostfd = open_clientfd(req_info.host, req_info.port ? req_info.port : "80");
+    if (hostfd < 0)
     {
-        hostfd = socket(rp->ai_family, rp->ai_socktype,
-                        rp->ai_protocol);
-        if (hostfd == -1)
-            continue;
-        if (connect(hostfd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break; /* Success */
-        close(hostfd);
-    }
-    if (rp == NULL)
-    { /* No address succeeded */
-        fprintf(stderr, "Could not connect\n");
+        LOG_WARN("Could not connect: %s", url);
+        metrics_transition(G_READ_CLIENT, G_READ_SERVER);
+        return cache_build_object(0, url, NULL); // nothing to send, not cached
     }
-    freeaddrinfo(result); /* No longer needed */
 
     //write
+    metrics_transition(G_READ_CLIENT, G_WRITE_SERVER);
     int myRequestLen = strlen(req_info.request);
     int bytesWritten = 0;
     while (bytesWritten != myRequestLen)
@@ -211,13 +197,15 @@ cache_object_t contact_host(req_info_t req_info, char *url)
         int checkErr = write(hostfd, req_info.request + bytesWritten, myRequestLen - bytesWritten);
         if (checkErr == -1)
         {
-            fprintf(stderr, "write error");
+            LOG_ERROR("write error: %s", strerror(errno));
             exit(EXIT_FAILURE);
         }
         bytesWritten += checkErr;
     }
+    metrics_inc(M_BYTES_TO_SERVER, bytesWritten);
+    metrics_transition(G_WRITE_SERVER, G_READ_SERVER);
 
-    char *content = malloc(MAX_OBJECT_SIZE); // TODO: Free this when?
+    char *content = malloc(MAX_OBJECT_SIZE); // freed with its cache object
     memset(content, 0, MAX_OBJECT_SIZE);
     int totalbytesRead = 0;
     int bytesRead = 0;
@@ -227,8 +215,10 @@ cache_object_t contact_host(req_info_t req_info, char *url)
         totalbytesRead += bytesRead;
     } while (bytesRead != 0);
     close(hostfd);
+    metrics_inc(M_BYTES_FROM_SERVER, totalbytesRead);
+    metrics_observe(H_UPSTREAM_USEC, metrics_now_usec() - upstream_start);
 
-    cache_object_t cache_object = cache_build_object(totalbytesRead, url, content);
+    cache_object_t *cache_object = cache_build_object(totalbytesRead, url, content);
     cache_insert(&cache, cache_object);
     return cache_object;
 }
@@ -241,30 +231,40 @@ char *logging(char *buf)
     char *temp = strtok(NULL, " ");
     char *url = malloc(strlen(temp) + 1);
     strcpy(url, temp);
-    logbuf_insert(&logbuf, url);
+    logbuf_insert(&logbuf, strdup(url)); // the logging thread frees its own copy
     return url;
 }
 
 void read_write(int clientfd)
 {
+    uint64_t start = metrics_now_usec();
     char *buf = malloc(MAX_OBJECT_SIZE);
     memset(buf, 0, MAX_OBJECT_SIZE);
     ssize_t nread = 0;
+    metrics_transition(-1, G_READ_CLIENT);
     while (!strstr(buf, "\r\n\r\n"))
     {
         nread += read(clientfd, buf + nread, MAX_OBJECT_SIZE);
     }
+    metrics_inc(M_BYTES_FROM_CLIENT, nread);
 
     char *url = logging(buf);
 
+    // either way we hold a reference, so eviction can't free the object mid-send
     cache_object_t *cache_object = cache_find_object(&cache, url);
     if (cache_object == NULL)
     {
         req_info_t req_info = parse_request(buf);
-        *cache_object = contact_host(req_info, url); // TODO: free content when done ONLY IF not stored in cache
+        cache_object = contact_host(req_info, url); // the object owns url now
         // free(req_info.host);
         // free(req_info.port);
         // free(req_info.request);
+        metrics_transition(G_READ_SERVER, G_WRITE_CLIENT);
+    }
+    else
+    {
+        free(url); // the cached object has its own copy
+        metrics_transition(G_READ_CLIENT, G_WRITE_CLIENT);
     }
 
     int contentLen = cache_object->size;
@@ -274,13 +274,19 @@ void read_write(int clientfd)
         int checkErr = write(clientfd, cache_object->content + bytesWritten, contentLen - bytesWritten);
         if (checkErr == -1)
         {
-            fprintf(stderr, "write error");
+            LOG_ERROR("write error: %s", strerror(errno));
             exit(EXIT_FAILURE);
         }
         bytesWritten += checkErr;
-        printf("bytesWritten: %d  contentLen: %d\n", bytesWritten, contentLen);
     }
+    LOG_DEBUG("wrote %d bytes to fd %d", bytesWritten, clientfd);
+    cache_release(cache_object);
     close(clientfd);
+    free(buf);
+    metrics_inc(M_BYTES_TO_CLIENT, bytesWritten);
+    metrics_inc(M_REQUESTS, 1);
+    metrics_transition(G_WRITE_CLIENT, -1);
+    metrics_observe(H_REQUEST_USEC, metrics_now_usec() - start);
     return;
 }
 
@@ -305,45 +311,160 @@ void *proxy_thread(void *vargp)
     {
         int clientfd = sbuf_remove(&sbuf); /* Remove clientfd from buffer */
         read_write(clientfd);              /* Service client */
+        __sync_fetch_and_sub(&inflight, 1);
         // close(clientfd); //done in another place
     }
 }
 
+void shutdown_handler(int sig)
+{
+    shutdown_requested = 1;
+}
+
+void reload_handler(int sig)
+{
+    reload_requested = 1;
+}
+
+// install handler without SA_RESTART so accept() returns EINTR promptly
+void install_handler(int signum, void (*handler)(int))
+{
+    struct sigaction action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    if (sigaction(signum, &action, NULL) < 0)
+    {
+        LOG_ERROR("sigaction error: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+// scrape-time gauges that live outside the metrics slots
+int metrics_extra(char *buf, int size)
+{
+    int queued;
+    sem_getvalue(&sbuf.items, &queued);
+    return snprintf(buf, size,
+                    "# TYPE proxy_sbuf_queue_depth gauge\nproxy_sbuf_queue_depth %d\n"
+                    "# TYPE proxy_cache_objects gauge\nproxy_cache_objects %d\n"
+                    "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %d\n",
+                    queued, cache_objects(&cache), cache.size);
+}
+
+// serve metrics on the optional admin port, argv[2]
+void start_admin(char **argv)
+{
+    if (argv[2] != NULL && metrics_admin_start(argv[2], metrics_extra) < 0)
+    {
+        LOG_ERROR("error opening admin port %s", argv[2]);
+    }
+}
+
+// start a fresh proxy and pass it our listening socket and cache contents.
+// Returns 0 once the new process has acknowledged that it is accepting,
+// -1 if we should keep listening ourselves.
+int reload(int listenfd, char **argv)
+{
+    int sock;
+    pid_t pid;
+
+    metrics_admin_stop(); // the new process binds the admin port itself
+    if ((pid = handoff_spawn(argv, &sock)) < 0)
+    {
+        LOG_ERROR("reload: spawn: %s", strerror(errno));
+        start_admin(argv);
+        return -1;
+    }
+    if (handoff_send_fd(sock, listenfd) < 0 ||
+        handoff_send_cache(sock, &cache) < 0 ||
+        handoff_wait_ack(sock) < 0)
+    {
+        LOG_WARN("reload: process %d did not take over, still listening", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sock);
+        start_admin(argv);
+        return -1;
+    }
+    close(sock);
+    LOG_INFO("reload: process %d is accepting, draining", pid);
+    return 0;
+}
+
+// wait for queued and in-progress connections and pending log lines
+void drain(void)
+{
+    int items;
+    while (1)
+    {
+        sem_getvalue(&logbuf.items, &items);
+        if (__sync_fetch_and_add(&inflight, 0) == 0 && items == 0)
+        {
+            return;
+        }
+        usleep(10000);
+    }
+}
+
+int open_listener(char *port)
+{
+    // dual-stack with the full LISTENQ backlog, and clients only reach
+    // accept once their request is in
+    listenopts_t opts;
+    int listenfd;
+    listenopts_init(&opts);
+    opts.dualstack = 1;
+    opts.defer_accept = 1;
+    if ((listenfd = open_listenfd_opts(port, &opts)) < 0)
+    {
+        LOG_ERROR("listen error: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    return listenfd;
+}
+
 // main
 int main(int argc, char *argv[])
 {
     if (argc < 2)
     {
-        printf("usage: %s port\n", argv[0]);
+        LOG_ERROR("usage: %s port [admin port]", argv[0]);
         exit(1);
     }
 
-    /* Provided server code */
-    struct sockaddr_in ip4addr;
-    ip4addr.sin_family = AF_INET;
-    ip4addr.sin_port = htons(atoi(argv[1]));
-    ip4addr.sin_addr.s_addr = INADDR_ANY;
     int listenfd;
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
-    {
-        perror("socket error");
-        exit(EXIT_FAILURE);
-    }
-    if (bind(listenfd, (struct sockaddr *)&ip4addr, sizeof(struct sockaddr_in)) < 0)
+    int handoff_sock;
+
+    log_init();
+
+    cache_init(&cache, MAX_CACHE_SIZE / 100); // max number of objects in cache
+
+    // a reloading parent hands us its listening socket and cache instead of us binding
+    if ((handoff_sock = handoff_inherited_sock()) >= 0)
     {
-        close(listenfd);
-        perror("bind error");
-        exit(EXIT_FAILURE);
+        if ((listenfd = handoff_recv_fd(handoff_sock)) < 0 ||
+            handoff_recv_cache(handoff_sock, &cache) < 0)
+        {
+            LOG_ERROR("error receiving state from old process");
+            exit(EXIT_FAILURE);
+        }
     }
-    if (listen(listenfd, 100) < 0)
+    else
     {
-        close(listenfd);
-        perror("listen error");
-        exit(EXIT_FAILURE);
+        listenfd = open_listener(argv[1]);
     }
-    /**/
 
-    cache_init(&cache, MAX_CACHE_SIZE / 100); // max number of objects in cache
+    // only the main thread handles shutdown/reload signals
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
     // Create threads
     pthread_t threadId;
@@ -359,14 +480,75 @@ int main(int argc, char *argv[])
         pthread_create(&threadId, NULL, proxy_thread, NULL);
     }
 
-    while (1)
+    start_admin(argv);
+
+    install_handler(SIGTERM, shutdown_handler);
+    install_handler(SIGINT, shutdown_handler);
+    install_handler(SIGHUP, reload_handler);
+    install_handler(SIGUSR2, reload_handler);
+
+    // the signals stay blocked except while we sleep in pselect, so one
+    // that arrives between the flag checks and the wait still wakes us
+    sigset_t waitmask;
+    pthread_sigmask(SIG_BLOCK, NULL, &waitmask);
+    sigdelset(&waitmask, SIGTERM);
+    sigdelset(&waitmask, SIGINT);
+    sigdelset(&waitmask, SIGHUP);
+    sigdelset(&waitmask, SIGUSR2);
+    // pselect can report a connection that is gone (or taken by the process
+    // we hand off to) by the time we accept, so accept must not block
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    if (handoff_sock >= 0)
+    {
+        // we are ready to accept; the old process can stop listening
+        handoff_ack(handoff_sock);
+        close(handoff_sock);
+    }
+
+    while (!shutdown_requested)
     {
+        if (reload_requested)
+        {
+            reload_requested = 0;
+            if (reload(listenfd, argv) == 0)
+            {
+                break;
+            }
+        }
+
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listenfd, &ready);
+        if (pselect(listenfd + 1, &ready, NULL, NULL, NULL, &waitmask) < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERROR("pselect error: %s", strerror(errno));
+            }
+            continue;
+        }
+
         // my server code
         struct sockaddr_storage peer_addr;
-        socklen_t peer_addr_len;
+        socklen_t peer_addr_len = sizeof(peer_addr);
         int clientfd = accept(listenfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
+        if (clientfd < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != ECONNABORTED)
+            {
+                LOG_ERROR("accept error: %s", strerror(errno));
+            }
+            continue;
+        }
+        __sync_fetch_and_add(&inflight, 1);
+        metrics_inc(M_CONNECTIONS, 1);
         sbuf_insert(&sbuf, clientfd); // Insert clientfd in buffer
     }
 
+    // stop accepting, let the workers finish what they have
+    close(listenfd);
+    drain();
     return 0;
 }
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
@@ -27,7 +28,9 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 /* Default file permissions are DEF_MODE & ~DEF_UMASK */
 /* $begin createmasks */
@@ -51,6 +54,31 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* Persistent state for Rio views: lines and records are handed back
+   as (pointer, length) views into a buffer of the caller's size,
+   which is only compacted or grown for a record that doesn't fit */
+/* $begin riov_t */
+typedef struct {
+    int rio_fd;                /* Descriptor for this buf */
+    char *rio_buf;             /* Malloc'd buffer of rio_size bytes */
+    size_t rio_size;
+    char *rio_start;           /* Next unconsumed byte in buf */
+    char *rio_end;             /* End of the bytes read into buf */
+} riov_t;
+/* $end riov_t */
+
+/* Listening socket options for open_listenfd_opts */
+/* $begin listenopts_t */
+typedef struct {
+    int backlog;      /* listen() backlog (capped by net.core.somaxconn) */
+    int reuseport;    /* SO_REUSEPORT: other sockets may bind the same port */
+    int defer_accept; /* TCP_DEFER_ACCEPT: secs to wait for data (0 = off) */
+    int fastopen;     /* TCP_FASTOPEN pending-request queue length (0 = off) */
+    int dualstack;    /* Prefer one IPv6 socket that also takes IPv4 */
+    int nonblock;     /* Make the listening socket non-blocking */
+} listenopts_t;
+/* $end listenopts_t */
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,6 +87,7 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#define CONNECT_DELAY 250 /* ms before open_clientfd races the next address */
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -178,6 +207,10 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_viewinit(riov_t *rp, int fd, size_t bufsize);
+void rio_viewfree(riov_t *rp);
+ssize_t rio_viewlineb(riov_t *rp, char **linep, size_t maxlen);
+ssize_t rio_viewnb(riov_t *rp, char **datap, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -185,14 +218,21 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_viewlineb(riov_t *rp, char **linep, size_t maxlen);
+ssize_t Rio_viewnb(riov_t *rp, char **datap, size_t n);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_list(struct addrinfo *listp);
 int open_listenfd(char *port);
+void listenopts_init(listenopts_t *opts);
+int listenopts_parse(listenopts_t *opts, char *spec);
+int open_listenfd_opts(char *port, listenopts_t *opts);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_opts(char *port, listenopts_t *opts);
 
 
 #endif /* __CSAPP_H__ */
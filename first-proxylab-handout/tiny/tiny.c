@@ -20,14 +20,20 @@ int main(int argc, char **argv)
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    listenopts_t opts;
+
+    /* Clients speak first, so accept needn't wake until they have */
+    listenopts_init(&opts);
+    opts.defer_accept = 1;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if ((argc != 2 && argc != 3) ||
+	(argc == 3 && listenopts_parse(&opts, argv[2]) < 0)) {
+	fprintf(stderr, "usage: %s <port> [listen options, e.g. backlog=4096,defer=0]\n", argv[0]);
 	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd_opts(argv[1], &opts);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
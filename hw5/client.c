@@ -5,22 +5,106 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
-#define BUF_SIZE 500
-#define MSG_MAX 4096
+/*
+ * Streams stdin to the server and the server's replies to stdout, in
+ * both directions at once: one poll() loop reads stdin in chunks,
+ * writes them to the socket as it drains, and reads whatever comes
+ * back, so neither side's buffers fill up and stall the other.  At
+ * the end it reports on stderr how many bytes went each way and how
+ * fast.
+ *
+ * Over TCP it shuts down its sending side at the end of stdin and
+ * reads until the server closes.  Over UDP (-u) every chunk is one
+ * datagram; to keep from overrunning the server's receive buffer it
+ * keeps at most WINDOW bytes unanswered, and counts anything still
+ * unanswered after LOSS_MS as lost.
+ */
+
+#define TCP_CHUNK 65536	 /* Bytes per write over TCP */
+#define UDP_CHUNK 1024	 /* Bytes per datagram (the most is 65507) */
+#define WINDOW 65536	 /* UDP bytes in flight */
+#define LOSS_MS 1000	 /* Silence after which UDP gives up on replies */
+#define RECV_SIZE 65536
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-u] [-c chunk] [-w window] [-q] host port < input\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* Write all of buf to fd, which may be stdout on a pipe */
+static void write_all(int fd, char *buf, ssize_t len)
+{
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = write(fd, buf, len)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		buf += n;
+		len -= n;
+	}
+}
 
 int main(int argc, char *argv[])
 {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
-	int sfd, s, j;
-	size_t len;
-	ssize_t nread;
-	char buf[BUF_SIZE];
+	struct pollfd fds[2];
+	int sfd, s, opt;
+	int udp = 0, quiet = 0, in_eof = 0, out_done = 0;
+	size_t chunk = 0, window = WINDOW;
+	ssize_t nread, nwritten;
+	char *out, *buf;
+	size_t out_pos = 0, out_len = 0;
+	long long sent = 0, received = 0, lost = 0, datagrams = 0, inflight;
+	double start, secs, last_reply;
 
-	if (argc < 3)
+	while ((opt = getopt(argc, argv, "uc:w:q")) != -1)
+	{
+		switch (opt)
+		{
+		case 'u':
+			udp = 1;
+			break;
+		case 'c':
+			chunk = atol(optarg);
+			break;
+		case 'w':
+			window = atol(optarg);
+			break;
+		case 'q':
+			quiet = 1; /* Count the replies, don't print them */
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+	if (chunk == 0)
+		chunk = udp ? UDP_CHUNK : TCP_CHUNK;
+	if ((udp && chunk > 65507) || window < chunk)
 	{
-		fprintf(stderr, "Usage: %s host port msg...\n", argv[0]);
+		fprintf(stderr, "chunk must be at most 65507 bytes over UDP, and no bigger than the window\n");
 		exit(EXIT_FAILURE);
 	}
 
@@ -28,12 +112,11 @@ int main(int argc, char *argv[])
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC; /* Allow IPv4 or IPv6 */
-	// hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
-	hints.ai_socktype = SOCK_STREAM; /* TCP socket */
+	hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
 	hints.ai_flags = 0;
 	hints.ai_protocol = 0; /* Any protocol */
 
-	s = getaddrinfo(argv[1], argv[2], &hints, &result);
+	s = getaddrinfo(argv[optind], argv[optind + 1], &hints, &result);
 	if (s != 0)
 	{
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
@@ -66,59 +149,127 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(result); /* No longer needed */
 
-	/* Send remaining command-line arguments as separate
-	   datagrams, and read responses from server */
-	char message[MSG_MAX];
-	int bytesRead = fread(message, 1, MSG_MAX, stdin);
-	//
-	int bytesWritten = 0;
-	while (bytesWritten != bytesRead)
+	/* From here on the socket never blocks; poll() says when to
+	   read and write it */
+	fcntl(sfd, F_SETFL, fcntl(sfd, F_GETFL, 0) | O_NONBLOCK);
+	out = malloc(chunk);
+	buf = malloc(RECV_SIZE);
+	if (out == NULL || buf == NULL)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	start = last_reply = now();
+	while (1)
 	{
-		int checkErr = write(sfd, message + bytesWritten, bytesRead - bytesWritten);
-		if (checkErr == -1)
+		/* Refill from stdin once the last chunk is all sent, and
+		   over UDP only while the window has room.  Signed, and never
+		   below 0: size_t chunk would make it unsigned, and replies
+		   given up as lost can still turn up */
+		inflight = sent - received - lost;
+		if (inflight < 0)
+			inflight = 0;
+		fds[0].fd = -1;
+		if (!in_eof && out_pos == out_len &&
+			(!udp || inflight + (long long)chunk <= (long long)window))
+			fds[0].fd = STDIN_FILENO;
+		fds[0].events = POLLIN;
+		fds[1].fd = sfd;
+		fds[1].events = POLLIN | (out_pos < out_len ? POLLOUT : 0);
+
+		if (poll(fds, 2, udp ? LOSS_MS : -1) == -1)
 		{
-			fprintf(stderr, "write error");
+			if (errno == EINTR)
+				continue;
+			perror("poll");
 			exit(EXIT_FAILURE);
 		}
-		bytesWritten += checkErr;
-	}
 
-	nread = read(sfd, buf, BUF_SIZE);
-	if (nread == -1)
-	{
-		perror("read");
-		exit(EXIT_FAILURE);
+		if (fds[0].fd >= 0 && fds[0].revents)
+		{
+			nread = read(STDIN_FILENO, out, chunk);
+			if (nread == -1 && errno != EINTR)
+			{
+				perror("read stdin");
+				exit(EXIT_FAILURE);
+			}
+			if (nread == 0)
+				in_eof = 1;
+			else if (nread > 0)
+			{
+				out_pos = 0;
+				out_len = nread;
+			}
+		}
+
+		/* Send as much of the chunk as the socket takes; a datagram
+		   goes whole or not at all */
+		while (out_pos < out_len)
+		{
+			nwritten = write(sfd, out + out_pos, out_len - out_pos);
+			if (nwritten == -1)
+			{
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+					(udp && errno == ENOBUFS))
+					break;
+				perror("write");
+				exit(EXIT_FAILURE);
+			}
+			out_pos += nwritten;
+			sent += nwritten;
+			datagrams += udp;
+		}
+
+		/* Take every reply that has arrived */
+		while ((nread = read(sfd, buf, RECV_SIZE)) > 0)
+		{
+			received += nread;
+			last_reply = now();
+			if (!quiet)
+				write_all(STDOUT_FILENO, buf, nread);
+		}
+		if (nread == 0 && !udp)
+			break; /* Server closed: TCP is done */
+		if (nread == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		{
+			perror("read");
+			exit(EXIT_FAILURE);
+		}
+
+		/* Over TCP, tell the server there's no more once it's all sent */
+		if (!udp && in_eof && out_pos == out_len && !out_done)
+		{
+			shutdown(sfd, SHUT_WR);
+			out_done = 1;
+		}
+
+		/* Replies that turn up after all were never lost */
+		if (received + lost > sent)
+			lost = sent - received > 0 ? sent - received : 0;
+
+		/* Over UDP, silence means the outstanding replies are lost */
+		if (udp && sent - received - lost > 0 && now() - last_reply >= LOSS_MS / 1000.0)
+		{
+			lost = sent - received;
+			last_reply = now();
+		}
+		if (udp && in_eof && out_pos == out_len && received + lost >= sent)
+			break;
 	}
-	fprintf(stdout, "%s\n", buf);
-
-	// for (j = 3; j < argc; j++)
-	// {
-	// 	len = strlen(argv[j]) + 1;
-	// 	/* +1 for terminating null byte */
-
-	// 	if (len + 1 > BUF_SIZE)
-	// 	{
-	// 		fprintf(stderr,
-	// 				"Ignoring long message in argument %d\n", j);
-	// 		continue;
-	// 	}
-
-	// 	sleep(2);
-	// 	if (write(sfd, argv[j], len) != len)
-	// 	{
-	// 		fprintf(stderr, "partial/failed write\n");
-	// 		exit(EXIT_FAILURE);
-	// 	}
-
-	// 	// nread = read(sfd, buf, BUF_SIZE);
-	// 	// if (nread == -1)
-	// 	// {
-	// 	// 	perror("read");
-	// 	// 	exit(EXIT_FAILURE);
-	// 	// }
-
-	// 	printf("Received %zd bytes: %s\n", nread, buf);
-	// }
+	secs = now() - start;
+
+	fprintf(stderr, "%s: sent %lld bytes", udp ? "udp" : "tcp", sent);
+	if (udp)
+		fprintf(stderr, " in %lld datagrams", datagrams);
+	fprintf(stderr, ", received %lld bytes", received);
+	if (lost > 0)
+		fprintf(stderr, " (%lld bytes lost)", lost);
+	fprintf(stderr, " in %.3f s: %.0f bytes/sec sent, %.0f bytes/sec received\n",
+			secs, sent / secs, received / secs);
 
+	free(out);
+	free(buf);
+	close(sfd);
 	exit(EXIT_SUCCESS);
 }
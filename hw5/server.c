@@ -1,40 +1,380 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg, accept4 */
 #include <sys/types.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netdb.h>
 
-#define BUF_SIZE 500
+/*
+ * Echoes everything it receives back to the sender.
+ *
+ * Over TCP (the default) one epoll loop serves any number of clients
+ * at once: each gets back what it sends, and a client too slow to
+ * take its echo only holds up itself.  Over UDP (-u) datagrams are
+ * taken VLEN at a time with recvmmsg() and returned in one
+ * sendmmsg().
+ *
+ * With -v it prints a line per connection (TCP) or datagram (UDP)
+ * naming the peer.  getnameinfo() may have to ask DNS, so names are
+ * looked up once per peer and kept in a small cache; without -v no
+ * lookups are done at all.
+ *
+ * Out of descriptors, the TCP server closes a spare it keeps for the
+ * purpose, accepts the oldest pending connection and hangs up on it,
+ * rather than leave it queued to wake the loop again at once.  If the
+ * spare is gone too, it stops watching the listener for PAUSE_MS.
+ */
+
+#define BUF_SIZE 65536	/* TCP read size */
+#define VLEN 64			/* Datagrams per recvmmsg()/sendmmsg() */
+#define DGRAM_MAX 65536 /* Largest datagram */
+#define MAXEVENTS 64
+#define NAME_CACHE 256	/* Peers whose names are remembered */
+#define PAUSE_MS 100	/* Listener ignored for this long with no fds */
+
+typedef struct
+{
+	int fd;
+	char *pending; /* Echo the client hasn't taken yet, if any */
+	size_t pend_pos, pend_len;
+} client_t;
+
+typedef struct
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char name[NI_MAXHOST + NI_MAXSERV + 1];
+} name_entry_t;
+
+static int verbose;
+static name_entry_t name_cache[NAME_CACHE];
+static int spare_fd = -1; /* Kept back to accept-and-drop with */
+static long dropped;	  /* Connections hung up on for want of fds */
+
+/* "host:port" for a peer address, from the cache when possible */
+static const char *peer_name(struct sockaddr *addr, socklen_t addr_len)
+{
+	unsigned char *p = (unsigned char *)addr;
+	unsigned hash = 2166136261u;
+	char host[NI_MAXHOST], service[NI_MAXSERV];
+	name_entry_t *e;
+	socklen_t i;
+	int s;
+
+	for (i = 0; i < addr_len; i++) /* FNV-1a over the address bytes */
+		hash = (hash ^ p[i]) * 16777619u;
+	e = &name_cache[hash % NAME_CACHE];
+	if (e->addr_len == addr_len && memcmp(&e->addr, addr, addr_len) == 0)
+		return e->name;
+
+	s = getnameinfo(addr, addr_len, host, NI_MAXHOST,
+					service, NI_MAXSERV, NI_NUMERICSERV);
+	if (s != 0)
+	{
+		fprintf(stderr, "getnameinfo: %s\n", gai_strerror(s));
+		return "?";
+	}
+	memcpy(&e->addr, addr, addr_len);
+	e->addr_len = addr_len;
+	snprintf(e->name, sizeof(e->name), "%s:%s", host, service);
+	return e->name;
+}
+
+static void client_close(client_t *c)
+{
+	close(c->fd); /* Also takes it out of the epoll set */
+	free(c->pending);
+	free(c);
+}
+
+/* Send what's pending for c; returns 1 once it's all gone, 0 if the
+   socket is full, -1 on error */
+static int client_flush(client_t *c)
+{
+	ssize_t n;
+
+	while (c->pend_pos < c->pend_len)
+	{
+		n = write(c->fd, c->pending + c->pend_pos, c->pend_len - c->pend_pos);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		c->pend_pos += n;
+	}
+	free(c->pending);
+	c->pending = NULL;
+	c->pend_pos = c->pend_len = 0;
+	return 1;
+}
+
+/* Watch c for input, or only for room to write while it has pending */
+static void client_watch(int efd, client_t *c)
+{
+	struct epoll_event ev;
+
+	ev.events = c->pending ? EPOLLOUT : EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(efd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		perror("epoll_ctl");
+}
+
+/* Echo what c has sent; level-triggered, so one read per wakeup */
+static void client_read(int efd, client_t *c)
+{
+	static char buf[BUF_SIZE];
+	ssize_t nread;
+
+	nread = read(c->fd, buf, BUF_SIZE);
+	if (nread == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (nread <= 0)
+	{
+		if (verbose)
+			printf("Connection on fd %d closed\n", c->fd);
+		client_close(c);
+		return;
+	}
+	c->pending = malloc(nread);
+	if (c->pending == NULL)
+	{
+		perror("malloc");
+		client_close(c);
+		return;
+	}
+	memcpy(c->pending, buf, nread);
+	c->pend_len = nread;
+	switch (client_flush(c))
+	{
+	case -1:
+		client_close(c);
+		break;
+	case 0:
+		client_watch(efd, c); /* Stop reading until it drains */
+		break;
+	}
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Out of descriptors: use the spare to accept the oldest pending
+   connection and hang up on it; returns -1 if there was no spare */
+static int drop_conn(int sfd)
+{
+	static time_t last_report;
+	int fd;
+
+	if (spare_fd == -1 && (spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	close(spare_fd);
+	if ((fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC)) != -1)
+	{
+		close(fd);
+		dropped++;
+	}
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	/* Say so at most once a second, not once a connection */
+	if (time(NULL) != last_report)
+	{
+		last_report = time(NULL);
+		fprintf(stderr, "Out of descriptors: %ld connections dropped so far\n", dropped);
+	}
+	return 0;
+}
+
+static void serve_tcp(int sfd)
+{
+	struct epoll_event ev, events[MAXEVENTS];
+	struct sockaddr_storage peer_addr;
+	socklen_t peer_addr_len;
+	client_t *c;
+	int efd, cfd, n, i, paused = 0;
+	long resume_at = 0;
+
+	if (listen(sfd, SOMAXCONN) == -1)
+	{
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	if ((efd = epoll_create1(0)) == -1)
+	{
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; /* The listening socket */
+	epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	for (;;)
+	{
+		if (paused && now_ms() >= resume_at)
+		{
+			ev.events = EPOLLIN;
+			ev.data.ptr = NULL;
+			epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+			paused = 0;
+		}
+		n = epoll_wait(efd, events, MAXEVENTS, paused ? PAUSE_MS : -1);
+		for (i = 0; i < n; i++)
+		{
+			c = events[i].data.ptr;
+			if (c == NULL)
+			{
+				peer_addr_len = sizeof(struct sockaddr_storage);
+				cfd = accept4(sfd, (struct sockaddr *)&peer_addr,
+							  &peer_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+				if (cfd == -1)
+				{
+					/* The listener is level-triggered: leaving the
+					   connection queued would wake us straight back */
+					if ((errno == EMFILE || errno == ENFILE) && drop_conn(sfd) == -1)
+					{
+						epoll_ctl(efd, EPOLL_CTL_DEL, sfd, NULL);
+						paused = 1;
+						resume_at = now_ms() + PAUSE_MS;
+					}
+					continue; /* Otherwise gone already */
+				}
+				if (verbose)
+					printf("Accepted connection from %s on fd %d\n",
+						   peer_name((struct sockaddr *)&peer_addr, peer_addr_len), cfd);
+				if ((c = calloc(1, sizeof(client_t))) == NULL)
+				{
+					close(cfd);
+					continue;
+				}
+				c->fd = cfd;
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				if (epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev) == -1)
+				{
+					perror("epoll_ctl");
+					client_close(c);
+				}
+			}
+			else if (c->pending)
+			{
+				if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+					client_flush(c) == -1)
+					client_close(c);
+				else if (c->pending == NULL)
+					client_watch(efd, c); /* Drained: read again */
+			}
+			else
+				client_read(efd, c);
+		}
+	}
+}
+
+static void serve_udp(int sfd)
+{
+	static char bufs[VLEN][DGRAM_MAX];
+	struct mmsghdr msgs[VLEN];
+	struct iovec iovs[VLEN];
+	struct sockaddr_storage addrs[VLEN];
+	int n, i, sent, m;
+
+	for (;;)
+	{
+		for (i = 0; i < VLEN; i++)
+		{
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = DGRAM_MAX;
+			memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		/* Wait for one datagram, then take any others already queued */
+		n = recvmmsg(sfd, msgs, VLEN, MSG_WAITFORONE, NULL);
+		if (n == -1)
+		{
+			if (errno != EINTR)
+				perror("recvmmsg");
+			continue; /* Ignore failed request */
+		}
+
+		/* Each reply goes back where its datagram came from */
+		for (i = 0; i < n; i++)
+		{
+			iovs[i].iov_len = msgs[i].msg_len;
+			if (verbose)
+				printf("Received %u bytes from %s\n", msgs[i].msg_len,
+					   peer_name(msgs[i].msg_hdr.msg_name, msgs[i].msg_hdr.msg_namelen));
+		}
+		for (sent = 0; sent < n; sent += m)
+		{
+			m = sendmmsg(sfd, msgs + sent, n - sent, 0);
+			if (m == -1)
+			{
+				if (errno == EINTR)
+				{
+					m = 0;
+					continue;
+				}
+				fprintf(stderr, "Error sending response: %s\n", strerror(errno));
+				m = 1; /* Drop the one that failed, send the rest */
+			}
+		}
+	}
+}
 
 int main(int argc, char *argv[])
 {
 	struct addrinfo hints;
 	struct addrinfo *result, *rp;
-	int sfd, s;
-	struct sockaddr_storage peer_addr;
-	socklen_t peer_addr_len;
-	ssize_t nread;
-	char buf[BUF_SIZE];
+	int sfd, s, opt, udp = 0;
 
-	if (argc != 2)
+	while ((opt = getopt(argc, argv, "uv")) != -1)
 	{
-		fprintf(stderr, "Usage: %s port\n", argv[0]);
+		switch (opt)
+		{
+		case 'u':
+			udp = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-u] [-v] port\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind != 1)
+	{
+		fprintf(stderr, "Usage: %s [-u] [-v] port\n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
 	memset(&hints, 0, sizeof(struct addrinfo));
 	hints.ai_family = AF_UNSPEC; /* Allow IPv4 or IPv6 */
-	// hints.ai_socktype = SOCK_DGRAM; /* Datagram socket */
-	hints.ai_socktype = SOCK_STREAM; /* TCP socket */
+	hints.ai_socktype = udp ? SOCK_DGRAM : SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;	 /* For wildcard IP address */
 	hints.ai_protocol = 0;			 /* Any protocol */
 	hints.ai_canonname = NULL;
 	hints.ai_addr = NULL;
 	hints.ai_next = NULL;
 
-	s = getaddrinfo(NULL, argv[1], &hints, &result);
+	s = getaddrinfo(NULL, argv[optind], &hints, &result);
 	if (s != 0)
 	{
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
@@ -48,7 +388,8 @@ int main(int argc, char *argv[])
 
 	for (rp = result; rp != NULL; rp = rp->ai_next)
 	{
-		sfd = socket(rp->ai_family, rp->ai_socktype,
+		/* The TCP listener must not block the epoll loop in accept() */
+		sfd = socket(rp->ai_family, rp->ai_socktype | (udp ? 0 : SOCK_NONBLOCK),
 					 rp->ai_protocol);
 		if (sfd == -1)
 			continue;
@@ -67,33 +408,10 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(result); /* No longer needed */
 
-	/* Read datagrams and echo them back to sender */
-
-	listen(sfd, 100);
-	accept(sfd, (struct sockaddr *)&peer_addr, &peer_addr_len);
-	for (;;)
-	{
-		peer_addr_len = sizeof(struct sockaddr_storage);
-		nread = recv(sfd, buf, BUF_SIZE, 0);
-		if (nread == 0)
-			break;
-		if (nread == -1)
-			continue; /* Ignore failed request */
-
-		char host[NI_MAXHOST], service[NI_MAXSERV];
-
-		s = getnameinfo((struct sockaddr *)&peer_addr,
-						peer_addr_len, host, NI_MAXHOST,
-						service, NI_MAXSERV, NI_NUMERICSERV);
-		if (s == 0)
-			printf("Received %zd bytes from %s:%s\n",
-				   nread, host, service);
-		else
-			fprintf(stderr, "getnameinfo: %s\n", gai_strerror(s));
-
-		if (sendto(sfd, buf, nread, 0,
-				   (struct sockaddr *)&peer_addr,
-				   peer_addr_len) != nread)
-			fprintf(stderr, "Error sending response\n");
-	}
+	signal(SIGPIPE, SIG_IGN); /* A client that vanishes is just closed */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (udp)
+		serve_udp(sfd);
+	else
+		serve_tcp(sfd);
 }
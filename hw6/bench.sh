@@ -0,0 +1,119 @@
+#!/bin/bash
+#
+# bench.sh - Load-tests the prethreaded echo server: for each worker
+#     count asked for, starts echoservert_pre with the main thread
+#     accepting into the sbuf and then with per-worker SO_REUSEPORT
+#     listeners (-r), drives it closed-loop with echobench and prints
+#     one line of throughput and latency percentiles per run.
+#
+#     usage: ./bench.sh [seconds] [clients] [lines per connection] [threads]
+#     e.g.   ./bench.sh 5 32 1 "1 8 32"
+#
+#     One line per connection (the default) makes every request a new
+#     connection, so accept is on the critical path; 0 keeps each
+#     client on one connection for the whole run, which needs at
+#     least as many worker threads as clients.
+#
+
+DURATION=${1:-5}
+CLIENTS=${2:-32}
+LINES=${3:-1}
+THREADS=${4:-"1 8 32"}
+
+PORT_START=1024
+PORT_MAX=65000
+MAX_RAND=63000
+MAX_PORT_TRIES=10
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Gives up after MAX_PORT_TRIES.
+#
+function wait_for_port_use() {
+    tries="0"
+    until netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+        | grep tcp | awk '{print $4}' | sed 's/.*://' \
+        | grep -wq "${1}"
+    do
+        tries=`expr ${tries} + 1`
+        if [ "${tries}" == "${MAX_PORT_TRIES}" ]; then
+            echo "Error: nothing listening on port ${1}"
+            cleanup
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+function cleanup {
+    kill $server_pid 2> /dev/null
+    wait $server_pid 2> /dev/null
+    rm -f bench.out
+}
+
+if [ ! -x ./echoservert_pre -o ! -x ./echobench ]; then
+    echo "Error: build echoservert_pre and echobench first (make bench does this)"
+    exit 1
+fi
+
+trap "cleanup; exit 1" INT TERM
+echo "*** Benchmark: echoservert_pre, ${CLIENTS} clients for ${DURATION}s per run, ${LINES} line(s) per connection"
+printf "%-8s %-10s %11s %11s %9s %9s %9s %7s\n" \
+    "threads" "accept" "lines/s" "conns/s" "p50 us" "p99 us" "p99.9 us" "errors"
+status=0
+for threads in ${THREADS}
+do
+    for mode in sbuf reuseport
+    do
+        flags=""
+        [ "${mode}" == "reuseport" ] && flags="-r"
+        port=$(free_port)
+        ./echoservert_pre -t ${threads} ${flags} ${port} &> /dev/null &
+        server_pid=$!
+        wait_for_port_use "${port}"
+
+        ./echobench -c ${CLIENTS} -d ${DURATION} -n ${LINES} localhost ${port} > bench.out
+        [ $? -ne 0 ] && status=2
+        # completed:  N lines, C connections, E errors
+        # throughput: L lines/s, M MB/s, R conns/s
+        # latency us: p50 A  p90 B  p99 C  p99.9 D  max E
+        awk -v threads="${threads}" -v mode="${mode}" '
+            /^completed:/  { errors = $6 }
+            /^throughput:/ { lps = $2; cps = $6 }
+            /^latency us:/ { p50 = $4; p99 = $8; p999 = $10 }
+            END { printf "%-8s %-10s %11s %11s %9s %9s %9s %7s\n",
+                         threads, mode, lps, cps, p50, p99, p999, errors }' bench.out
+        kill $server_pid 2> /dev/null
+        wait $server_pid 2> /dev/null
+    done
+done
+
+cleanup
+exit ${status}
@@ -0,0 +1,134 @@
+#!/bin/bash
+#
+# compare.sh - Compares the echo servers' concurrency models: starts
+#     each server in turn, has echobench open N concurrent clients
+#     that each send M lines of the given size on one connection, and
+#     prints a table of throughput, round-trip latency percentiles,
+#     the server's peak RSS and thread count, and the context switches
+#     it made, the last three from /proc.
+#
+#     usage: ./compare.sh [clients] [lines per client] [line size] [models]
+#     e.g.   ./compare.sh 64 2000 128 "i p t t_pre e"
+#
+#     models is a space-separated list of suffixes: i (iterative), p
+#     (process per connection), t (thread per connection), t_pre
+#     (prethreaded) and e (epoll).  Every model gets the same work, so
+#     the iterative server just takes its clients one after another,
+#     and so does the prethreaded one past its 10 threads and 16 queue
+#     slots; their latency shows the wait.
+#
+
+CLIENTS=${1:-32}
+LINES=${2:-2000}
+SIZE=${3:-64}
+MODELS=${4:-"i p t t_pre e"}
+TIMEOUT=${TIMEOUT:-120}
+
+PORT_START=1024
+PORT_MAX=65000
+MAX_RAND=63000
+MAX_PORT_TRIES=10
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Gives up after MAX_PORT_TRIES.
+#
+function wait_for_port_use() {
+    tries="0"
+    until netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+        | grep tcp | awk '{print $4}' | sed 's/.*://' \
+        | grep -wq "${1}"
+    do
+        tries=`expr ${tries} + 1`
+        if [ "${tries}" == "${MAX_PORT_TRIES}" ]; then
+            echo "Error: nothing listening on port ${1}"
+            cleanup
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+function cleanup {
+    # echoserverp's children outlive it until their clients hang up
+    pkill -P $server_pid 2> /dev/null
+    kill $server_pid 2> /dev/null
+    wait $server_pid 2> /dev/null
+    rm -f compare.out
+}
+
+for model in ${MODELS}
+do
+    if [ ! -x ./echoserver${model} ]; then
+        echo "Error: no ./echoserver${model} (make compare builds them all)"
+        exit 1
+    fi
+done
+if [ ! -x ./echobench ]; then
+    echo "Error: build echobench first (make compare does this)"
+    exit 1
+fi
+
+trap "cleanup; exit 1" INT TERM
+echo "*** Comparison: ${CLIENTS} clients x ${LINES} lines of ${SIZE} bytes per model"
+printf "%-16s %9s %7s %8s %8s %9s %9s %7s %10s %9s %6s\n" \
+    "server" "lines/s" "MB/s" "p50 us" "p99 us" "p99.9 us" "RSS KB" \
+    "threads" "vol cs" "invol cs" "errors"
+status=0
+for model in ${MODELS}
+do
+    port=$(free_port)
+    # the older servers print a line per line echoed; keep the terminal out of it
+    ./echoserver${model} ${port} &> /dev/null &
+    server_pid=$!
+    wait_for_port_use "${port}"
+
+    ./echobench -c ${CLIENTS} -m ${LINES} -l ${SIZE} -d ${TIMEOUT} \
+        -p ${server_pid} localhost ${port} > compare.out
+    [ $? -ne 0 ] && status=2
+    # completed:  N lines, C connections, E errors
+    # throughput: L lines/s, M MB/s, R conns/s
+    # latency us: p50 A  p90 B  p99 C  p99.9 D  max E
+    # server:     rss K KB, P processes, T threads (peaks); ctx switches V voluntary, I involuntary
+    awk -v server="echoserver${model}" -v want=$((CLIENTS * LINES)) '
+        /^completed:/  { lines = $2; errors = $6 + (want - lines) }
+        /^throughput:/ { lps = $2; mbs = $4 }
+        /^latency us:/ { p50 = $4; p99 = $8; p999 = $10 }
+        /^server:/     { rss = $3; threads = $7; vol = $12; invol = $14 }
+        END { printf "%-16s %9s %7s %8s %8s %9s %9s %7s %10s %9s %6s\n",
+                     server, lps, mbs, p50, p99, p999, rss, threads,
+                     vol, invol, errors }' compare.out
+    pkill -P $server_pid 2> /dev/null
+    kill $server_pid 2> /dev/null
+    wait $server_pid 2> /dev/null
+done
+
+cleanup
+exit ${status}
@@ -1,5 +1,6 @@
 /*
- * echo - read and echo text lines until client closes connection
+ * echo - read and echo text lines until client closes connection;
+ *     each line is written back straight out of the Rio view buffer
  */
 /* $begin echo */
 #include "csapp.h"
@@ -7,14 +8,15 @@
 void echo(int connfd) 
 {
     size_t n; 
-    char buf[MAXLINE]; 
-    rio_t rio;
+    char *line; 
+    riov_t rio;
 
-    Rio_readinitb(&rio, connfd);
-    while((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) { //line:netp:echo:eof
+    rio_viewinit(&rio, connfd, RIO_BUFSIZE);
+    while((n = Rio_viewlineb(&rio, &line, MAXLINE)) != 0) { //line:netp:echo:eof
 	printf("server received %d bytes\n", (int)n);
-	Rio_writen(connfd, buf, n);
+	Rio_writen(connfd, line, n);
     }
+    rio_viewfree(&rio);
 }
 /* $end echo */
 
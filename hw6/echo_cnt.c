@@ -1,36 +1,97 @@
-/* 
+/*
  * A thread-safe version of echo that counts the total number
  * of bytes received from clients.
+ *
+ * Each thread counts into its own counter, padded out to a cache
+ * line, so echoing a line writes nothing another thread touches.  A
+ * reporter thread sums the counters once a second and prints the
+ * total when it has changed.
  */
 /* $begin echo_cnt */
 #include "csapp.h"
 
-static int byte_cnt;  /* Byte counter */
-static sem_t mutex;   /* and the mutex that protects it */
+#define MAXCOUNTERS 256  /* Threads with a counter of their own */
+#define CACHELINE   64
+#define REPORT_SECS 1
+
+typedef struct {
+    volatile long bytes;  /* Written only by the thread that owns it */
+    char pad[CACHELINE - sizeof(long)];
+} counter_t;
+
+static counter_t counters[MAXCOUNTERS] __attribute__((aligned(CACHELINE)));
+static int ncounters;           /* Counters handed out so far */
+static long overflow_cnt;       /* Shared, atomic, for any threads beyond */
+static sem_t mutex;             /* Protects ncounters */
+static __thread counter_t *my_counter;
+
+/* Sum of every thread's count: exact once the threads are idle, and
+   never more than a line or so per thread behind otherwise */
+long echo_cnt_total(void)
+{
+    long total = __sync_fetch_and_add(&overflow_cnt, 0);
+    int i, n = ncounters;
+
+    for (i = 0; i < n; i++)
+	total += counters[i].bytes;
+    return total;
+}
+
+static void *reporter(void *vargp)
+{
+    long total, last = 0;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+	sleep(REPORT_SECS);
+	if ((total = echo_cnt_total()) != last) {
+	    printf("server received %ld total bytes (%ld bytes/s)\n",
+		   total, (total - last) / REPORT_SECS);
+	    fflush(stdout);
+	    last = total;
+	}
+    }
+    return NULL;
+}
 
 static void init_echo_cnt(void)
 {
+    pthread_t tid;
+
     Sem_init(&mutex, 0, 1);
-    byte_cnt = 0;
+    Pthread_create(&tid, NULL, reporter, NULL);
+}
+
+/* The calling thread's counter, or NULL once they have run out */
+static counter_t *get_counter(void)
+{
+    if (my_counter == NULL) {
+	P(&mutex);
+	if (ncounters < MAXCOUNTERS)
+	    my_counter = &counters[ncounters++];
+	V(&mutex);
+    }
+    return my_counter;
 }
 
-void echo_cnt(int connfd) 
+void echo_cnt(int connfd)
 {
-    int n; 
-    char buf[MAXLINE]; 
-    rio_t rio;
+    int n;
+    char *line;
+    riov_t rio;
+    counter_t *counter;
     static pthread_once_t once = PTHREAD_ONCE_INIT;
 
     Pthread_once(&once, init_echo_cnt); //line:conc:pre:pthreadonce
-    Rio_readinitb(&rio, connfd);        //line:conc:pre:rioinitb
-    while((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-	P(&mutex);
-	byte_cnt += n; //line:conc:pre:cntaccess1
-	printf("server received %d (%d total) bytes on fd %d\n", 
-	       n, byte_cnt, connfd); //line:conc:pre:cntaccess2
-	V(&mutex);
-	Rio_writen(connfd, buf, n);
+    counter = get_counter();
+    rio_viewinit(&rio, connfd, RIO_BUFSIZE); //line:conc:pre:rioinitb
+    while((n = Rio_viewlineb(&rio, &line, MAXLINE)) != 0) {
+	if (counter)
+	    counter->bytes += n; //line:conc:pre:cntaccess1
+	else
+	    __sync_fetch_and_add(&overflow_cnt, n);
+	Rio_writen(connfd, line, n);
     }
+    rio_viewfree(&rio);
 }
 /* $end echo_cnt */
-
@@ -0,0 +1,340 @@
+/*
+ * echobench.c - Closed-loop load generator for the echo servers.  Each
+ *     client thread keeps one connection busy: it writes a line, waits
+ *     for the whole line to come back, and repeats, reconnecting every
+ *     -n lines (so -n 1 measures connection setup, accept included,
+ *     and -n 0 keeps one connection for the whole run).  It prints the
+ *     lines, bytes and connections per second and percentiles of the
+ *     round-trip time; the first line on a connection counts its
+ *     connect too.
+ *
+ *     With -m each client instead sends exactly that many lines on
+ *     one connection, and the run ends when they all have (or after
+ *     -d seconds, 60 by default), so every server model gets the same
+ *     work.  With -p it also samples the server's process, and any it
+ *     forks, from /proc every SAMPLE_MS: peak resident memory (summed
+ *     over the processes, so shared pages count more than once) and
+ *     the context switches its threads made during the run.
+ *
+ *     usage: echobench [-c clients] [-d secs] [-n lines/conn | -m lines]
+ *                      [-l linelen] [-p server pid] host port
+ */
+/* $begin echobench */
+#include <time.h>
+#include "csapp.h"
+
+#define SAMPLE_MS 100
+
+#define CLIENTS   8
+#define DURATION  5
+#define LINELEN   64
+
+typedef struct {
+    unsigned *lat;      /* Round-trip times in us, one per line */
+    size_t nlat, size;
+    long conns, errors;
+    char pad[64];       /* Keep the threads' counters off shared lines */
+} client_t;
+
+static struct addrinfo *addrs;  /* The server, resolved once */
+static int duration = DURATION, linelen = LINELEN, perconn = 0, nlines = 0;
+static volatile int stop, ndone;
+
+/* The server's threads, with their context switches when last seen */
+typedef struct {
+    int tid;
+    long vol, invol;
+} task_t;
+
+static int server_pid;
+static task_t *tasks;
+static int ntasks, tasksize;
+static long base_vol, base_invol;
+static long peak_rss, peak_procs, peak_threads;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *client(void *vargp)
+{
+    client_t *c = vargp;
+    char *line = Malloc(linelen), *reply = Malloc(linelen);
+    int i, fd = -1, sent = 0, one = 1;
+    double start;
+
+    for (i = 0; i < linelen - 1; i++)
+	line[i] = 'a' + i % 26;
+    line[linelen - 1] = '\n';
+    while (!stop) {
+	start = now();
+	if (fd < 0) {
+	    if ((fd = open_clientfd_list(addrs)) < 0) {
+		c->errors++;
+		usleep(1000);
+		continue;
+	    }
+	    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	    c->conns++;
+	    sent = 0;
+	}
+	if (rio_writen(fd, line, linelen) != linelen ||
+	    rio_readn(fd, reply, linelen) != linelen) {
+	    c->errors++;
+	    close(fd);
+	    fd = -1;
+	    continue;
+	}
+	if (c->nlat == c->size) {
+	    c->size = c->size ? c->size * 2 : 65536;
+	    c->lat = Realloc(c->lat, c->size * sizeof(unsigned));
+	}
+	c->lat[c->nlat++] = (now() - start) * 1e6;
+	if (perconn && ++sent == perconn) {
+	    close(fd);
+	    fd = -1;
+	}
+	if (nlines && c->nlat == nlines)
+	    break;  /* Done its share */
+    }
+    __sync_fetch_and_add(&ndone, 1);
+    if (fd >= 0)
+	close(fd);
+    Free(line);
+    Free(reply);
+    return NULL;
+}
+
+/* Pick VmRSS and the context switch counts out of a status file */
+static int read_status(char *path, long *rss, long *vol, long *invol)
+{
+    char line[MAXLINE];
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+	return -1;  /* Exited meanwhile */
+    while (fgets(line, sizeof(line), fp)) {
+	if (!strncmp(line, "VmRSS:", 6))
+	    *rss = atol(line + 6);
+	else if (!strncmp(line, "voluntary_ctxt_switches:", 24))
+	    *vol = atol(line + 24);
+	else if (!strncmp(line, "nonvoluntary_ctxt_switches:", 27))
+	    *invol = atol(line + 27);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/* Is pid the server or one of its descendants? */
+static int in_server(int pid)
+{
+    char path[64], buf[512], *p;
+    int depth, fd, n;
+
+    for (depth = 0; depth < 16 && pid > 1; depth++) {
+	if (pid == server_pid)
+	    return 1;
+	sprintf(path, "/proc/%d/stat", pid);
+	if ((fd = open(path, O_RDONLY)) < 0)
+	    return 0;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	/* "pid (comm) state ppid ...", and comm may hold anything */
+	if (n <= 0 || (buf[n] = '\0', p = strrchr(buf, ')')) == NULL)
+	    return 0;
+	pid = atoi(p + 4);
+    }
+    return 0;
+}
+
+/* Note tid's latest counts, adding it if it is new */
+static void record_task(int tid, long vol, long invol)
+{
+    int i;
+
+    for (i = 0; i < ntasks && tasks[i].tid != tid; i++)
+	;
+    if (i == ntasks) {
+	if (ntasks == tasksize) {
+	    tasksize = tasksize ? tasksize * 2 : 64;
+	    tasks = Realloc(tasks, tasksize * sizeof(task_t));
+	}
+	tasks[ntasks++].tid = tid;
+    }
+    tasks[i].vol = vol;
+    tasks[i].invol = invol;
+}
+
+/* One pass over /proc for the server's processes and threads */
+static void sample(void)
+{
+    char path[320];
+    struct dirent *pe, *te;
+    DIR *proc, *task;
+    long rss, taskrss, procrss = 0, vol, invol, procs = 0, threads = 0;
+    int pid;
+
+    if ((proc = opendir("/proc")) == NULL)
+	return;
+    while ((pe = readdir(proc)) != NULL) {
+	if ((pid = atoi(pe->d_name)) <= 0 || !in_server(pid))
+	    continue;
+	sprintf(path, "/proc/%d/status", pid);
+	rss = 0;
+	if (read_status(path, &rss, &vol, &invol) < 0)
+	    continue;
+	procs++;
+	sprintf(path, "/proc/%d/task", pid);
+	if ((task = opendir(path)) == NULL)
+	    continue;
+	/* A main thread that has called pthread_exit shows no VmRSS, so
+	   take the process's from whichever of its threads does */
+	while ((te = readdir(task)) != NULL) {
+	    if (atoi(te->d_name) <= 0)
+		continue;
+	    sprintf(path, "/proc/%d/task/%s/status", pid, te->d_name);
+	    taskrss = 0;
+	    if (read_status(path, &taskrss, &vol, &invol) == 0) {
+		record_task(atoi(te->d_name), vol, invol);
+		threads++;
+		if (taskrss > rss)
+		    rss = taskrss;
+	    }
+	}
+	closedir(task);
+	procrss += rss;
+    }
+    closedir(proc);
+    if (procrss > peak_rss)
+	peak_rss = procrss;
+    if (procs > peak_procs)
+	peak_procs = procs;
+    if (threads > peak_threads)
+	peak_threads = threads;
+}
+
+static void *sampler(void *vargp)
+{
+    while (!stop) {
+	usleep(SAMPLE_MS * 1000);
+	sample();
+    }
+    return NULL;
+}
+
+static int cmp_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-c clients] [-d secs] [-n lines/conn | -m lines] "
+	    "[-l linelen] [-p server pid] host port\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt, nclients = CLIENTS;
+    client_t *clients;
+    pthread_t *tids, sampler_tid;
+    unsigned *lat;
+    size_t n = 0;
+    long conns = 0, errors = 0, vol = 0, invol = 0;
+    double start, secs;
+    struct addrinfo hints;
+
+    while ((opt = getopt(argc, argv, "c:d:n:m:l:p:")) != -1) {
+	switch (opt) {
+	case 'c': nclients = atoi(optarg); break;
+	case 'd': duration = atoi(optarg); break;
+	case 'n': perconn = atoi(optarg); break;
+	case 'm': nlines = atoi(optarg); break;
+	case 'l': linelen = atoi(optarg); break;
+	case 'p': server_pid = atoi(optarg); break;
+	default:  usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2 || nclients <= 0 || duration <= 0 ||
+	perconn < 0 || nlines < 0 || (nlines && perconn) ||
+	linelen < 1 || linelen > MAXLINE - 1 || server_pid < 0)
+	usage(argv[0]);
+    if (nlines && duration == DURATION)
+	duration = 60;  /* Only a limit: the work decides how long it takes */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    Getaddrinfo(argv[optind], argv[optind + 1], &hints, &addrs);
+    Signal(SIGPIPE, SIG_IGN);
+
+    if (server_pid) {
+	sample();  /* The counts so far are not the run's */
+	for (i = 0; i < ntasks; i++) {
+	    base_vol += tasks[i].vol;
+	    base_invol += tasks[i].invol;
+	}
+	peak_rss = peak_procs = peak_threads = 0;
+	Pthread_create(&sampler_tid, NULL, sampler, NULL);
+    }
+
+    clients = Calloc(nclients, sizeof(client_t));
+    tids = Malloc(nclients * sizeof(pthread_t));
+    start = now();
+    for (i = 0; i < nclients; i++)
+	Pthread_create(&tids[i], NULL, client, &clients[i]);
+    while (ndone < nclients && now() - start < duration)
+	usleep(10000);
+    if (server_pid)
+	sample();  /* Before the clients hang up and any children exit */
+    stop = 1;
+    for (i = 0; i < nclients; i++) {
+	Pthread_join(tids[i], NULL);
+	n += clients[i].nlat;
+	conns += clients[i].conns;
+	errors += clients[i].errors;
+    }
+    secs = now() - start;
+    if (server_pid) {
+	Pthread_join(sampler_tid, NULL);
+	for (i = 0; i < ntasks; i++) {
+	    vol += tasks[i].vol;
+	    invol += tasks[i].invol;
+	}
+	Free(tasks);
+    }
+
+    /* Merge the threads' samples for the percentiles */
+    lat = Malloc((n ? n : 1) * sizeof(unsigned));
+    for (n = 0, i = 0; i < nclients; i++) {
+	memcpy(lat + n, clients[i].lat, clients[i].nlat * sizeof(unsigned));
+	n += clients[i].nlat;
+	Free(clients[i].lat);
+    }
+    qsort(lat, n, sizeof(unsigned), cmp_unsigned);
+
+    printf("completed:  %zu lines, %ld connections, %ld errors\n", n, conns, errors);
+    printf("throughput: %.1f lines/s, %.2f MB/s, %.1f conns/s\n",
+	   n / secs, n * linelen / secs / 1e6, conns / secs);
+    if (n > 0)
+	printf("latency us: p50 %u  p90 %u  p99 %u  p99.9 %u  max %u\n",
+	       lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100],
+	       lat[n * 999 / 1000], lat[n - 1]);
+    if (server_pid)
+	printf("server:     rss %ld KB, %ld processes, %ld threads (peaks); "
+	       "ctx switches %ld voluntary, %ld involuntary\n",
+	       peak_rss, peak_procs, peak_threads,
+	       vol - base_vol, invol - base_invol);
+    Free(lat);
+    Free(tids);
+    Free(clients);
+    Freeaddrinfo(addrs);
+    exit(errors > 0 && n == 0);
+}
+/* $end echobench */
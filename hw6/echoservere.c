@@ -0,0 +1,329 @@
+/*
+ * echoservere.c - An event-driven concurrent echo server using epoll
+ *
+ *     A few threads (-t, 4 by default) each wait on their own epoll
+ *     set.  All of them watch the one non-blocking listening socket
+ *     (EPOLLEXCLUSIVE wakes just one per new connection) and serve
+ *     the connections they accept for as long as those last.
+ *
+ *     Connections are edge-triggered: on every wakeup a thread reads
+ *     until the socket would block, into a ring buffer that exists
+ *     only while the connection has unechoed bytes, so an idle
+ *     connection costs a socket and a few words.  All the whole lines
+ *     read go back in one writev of the ring's (at most two) pieces.
+ *     A client that stops reading its echoes fills its ring, and then
+ *     the server stops reading from it until it catches up.  One that
+ *     streams faster than it can be served gets MAXROUNDS ringfuls
+ *     per wakeup and then goes to the back of the ready list, so it
+ *     can't starve the rest of its thread's connections.
+ *
+ *     Out of descriptors, a thread closes the spare it keeps for the
+ *     purpose, accepts the oldest pending connection and hangs up on
+ *     it, rather than leaving it queued to wake every thread again at
+ *     once.  If the spare is gone too, the thread stops watching the
+ *     listener for PAUSE_MS.
+ */
+/* $begin echoservere */
+#include "csapp.h"
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+
+#define NTHREADS   4
+#define MAXEVENTS  256
+#define MAXACCEPTS 64    /* Connections accepted per listener wakeup */
+#define RINGSIZE   8192  /* Unechoed bytes held per connection */
+#define MAXROUNDS  16    /* Ringfuls served per wakeup before requeueing */
+#define PAUSE_MS   100   /* Listener ignored for this long with no fds */
+
+typedef struct {
+    int fd;
+    char *ring;          /* RINGSIZE bytes, or NULL while empty */
+    size_t head;         /* Stream offsets: [head, tail) is unsent, */
+    size_t ready;        /* ... [head, ready) is whole lines, ready */
+    size_t tail;         /* ... to go back out */
+    int eof;             /* Client has shut down its side */
+} conn_t;
+
+/* Linux's; <sys/socket.h> declares it only under _GNU_SOURCE, which
+   would clash with csapp.h's gai_error */
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
+
+void *thread(void *vargp);
+
+int listenfd;
+static long dropped;         /* Connections hung up on for want of fds */
+static time_t last_report;   /* When "dropped" was last reported */
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t nthreads] <port> [listen options, e.g. backlog=4096,defer=1]\n", prog);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    int i, opt, nthreads = NTHREADS;
+    listenopts_t opts;
+    struct rlimit rl;
+    pthread_t tid;
+
+    listenopts_init(&opts);
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+	switch (opt) {
+	case 't':
+	    if ((nthreads = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if ((argc - optind != 1 && argc - optind != 2) ||
+	(argc - optind == 2 && listenopts_parse(&opts, argv[optind + 1]) < 0))
+	usage(argv[0]);
+
+    /* One descriptor per connection: take all the kernel allows */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    Signal(SIGPIPE, SIG_IGN);
+
+    opts.nonblock = 1;  /* Threads accept until the queue is empty */
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
+    for (i = 0; i < nthreads; i++)
+	Pthread_create(&tid, NULL, thread, NULL);
+    Pthread_exit(NULL);
+}
+
+static void conn_close(conn_t *c)
+{
+    Close(c->fd);  /* Also drops it from the epoll set */
+    if (c->ring)
+	Free(c->ring);
+    Free(c);
+}
+
+/*
+ * conn_read - Read into c's ring until the socket would block, the
+ *     client shuts down or the ring is full.  Returns 1 if the ring
+ *     filled (so there may be more to read), 0 otherwise, or -1 on
+ *     error.
+ */
+static int conn_read(conn_t *c)
+{
+    struct iovec iov[2];
+    size_t start, room, p;
+    ssize_t n;
+
+    while (!c->eof && (room = RINGSIZE - (c->tail - c->head)) > 0) {
+	if (c->ring == NULL)
+	    c->ring = Malloc(RINGSIZE);
+	start = c->tail % RINGSIZE;
+	iov[0].iov_base = c->ring + start;
+	iov[0].iov_len = room < RINGSIZE - start ? room : RINGSIZE - start;
+	iov[1].iov_base = c->ring;
+	iov[1].iov_len = room - iov[0].iov_len;
+	if ((n = readv(c->fd, iov, iov[1].iov_len ? 2 : 1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+	if (n == 0) {
+	    c->eof = 1;
+	    break;
+	}
+	/* Whole lines are ready up to the last newline just read */
+	for (p = c->tail + n; p > c->tail; p--)
+	    if (c->ring[(p - 1) % RINGSIZE] == '\n') {
+		c->ready = p;
+		break;
+	    }
+	c->tail += n;
+    }
+    /* A full ring, or what's left at EOF, goes out line or no line */
+    if (c->eof || c->tail - c->head == RINGSIZE)
+	c->ready = c->tail;
+    return !c->eof && c->tail - c->head == RINGSIZE;
+}
+
+/*
+ * conn_write - Send c's ready bytes.  Returns 1 if the socket filled
+ *     first, 0 once they are all sent, or -1 on error.
+ */
+static int conn_write(conn_t *c)
+{
+    struct iovec iov[2];
+    size_t start, len;
+    ssize_t n;
+
+    while (c->head < c->ready) {
+	start = c->head % RINGSIZE;
+	len = c->ready - c->head;
+	iov[0].iov_base = c->ring + start;
+	iov[0].iov_len = len < RINGSIZE - start ? len : RINGSIZE - start;
+	iov[1].iov_base = c->ring;
+	iov[1].iov_len = len - iov[0].iov_len;
+	if ((n = writev(c->fd, iov, iov[1].iov_len ? 2 : 1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+	}
+	c->head += n;
+    }
+    /* Nothing held back: give the ring up until more arrives */
+    if (c->head == c->tail && c->ring) {
+	Free(c->ring);
+	c->ring = NULL;
+    }
+    return 0;
+}
+
+/* Handle an event on c; edge-triggered, so keep going until the
+   socket would block one way or the other, or c has had its turn */
+static void serve(int epfd, conn_t *c)
+{
+    struct epoll_event ev;
+    int rc, wc, rounds;
+
+    for (rounds = 0; rounds < MAXROUNDS; rounds++) {
+	rc = conn_read(c);
+	wc = conn_write(c);
+	if (rc < 0 || wc < 0 || (c->eof && c->head == c->tail)) {
+	    conn_close(c);
+	    return;
+	}
+	if (rc == 0 || wc == 1)
+	    return;  /* Wait for more input or for room to write */
+    }
+    /* Still more to read: re-arming a ready descriptor puts it at the
+       back of the ready list, behind everyone else's events */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+/*
+ * drop_conn - Out of descriptors: use the spare to accept the oldest
+ *     pending connection and hang up on it.  Returns 1 if it did, 0 if
+ *     nothing was pending, or -1 if there was no spare to use.
+ */
+static int drop_conn(int *sparefd)
+{
+    time_t now;
+    int fd, rc = 0;
+
+    if (*sparefd < 0 && (*sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)
+	return -1;
+    close(*sparefd);
+    if ((fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+	close(fd);
+	__sync_fetch_and_add(&dropped, 1);
+	rc = 1;
+    }
+    *sparefd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (rc == 0)
+	return 0;
+
+    /* Say so at most once a second, not once a connection */
+    now = time(NULL);
+    if (now != last_report) {
+	last_report = now;
+	fprintf(stderr, "out of descriptors: %ld connections dropped so far\n",
+		__sync_fetch_and_add(&dropped, 0));
+    }
+    return 1;
+}
+
+/* Accept a batch of new connections onto this thread's epoll set.
+   Returns -1 if the listener has to be ignored for a while, else 0 */
+static int accept_conns(int epfd, int *sparefd)
+{
+    struct epoll_event ev;
+    conn_t *c;
+    int i, connfd, rc;
+
+    for (i = 0; i < MAXACCEPTS; i++) {
+	if ((connfd = accept4(listenfd, NULL, NULL,
+			      SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    /* accept4 fails this way before looking at the queue, so only
+	       drop_conn can tell whether there is anything to drop */
+	    if (errno == EMFILE || errno == ENFILE) {
+		if ((rc = drop_conn(sparefd)) <= 0)
+		    return rc;
+		continue;
+	    }
+	    if (errno != EAGAIN && errno != EWOULDBLOCK)
+		fprintf(stderr, "accept4 error: %s\n", strerror(errno));
+	    return 0;  /* Queue empty */
+	}
+	c = Calloc(1, sizeof(conn_t));
+	c->fd = connfd;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0)
+	    unix_error("epoll_ctl error");
+    }
+    return 0;
+}
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Start (or resume) watching the listener */
+static void watch_listener(int epfd)
+{
+    struct epoll_event ev;
+
+    /* Level-triggered, so connections left queued wake us again */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0)
+	unix_error("epoll_ctl error");
+}
+
+void *thread(void *vargp)
+{
+    struct epoll_event events[MAXEVENTS];
+    int epfd, i, n, sparefd, paused = 0;
+    long resume_at = 0;         /* While paused: when to watch again */
+
+    Pthread_detach(pthread_self());
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	unix_error("epoll_create1 error");
+    /* Held back so there is always a descriptor to accept-and-drop with */
+    sparefd = Open("/dev/null", O_RDONLY | O_CLOEXEC, 0);
+    watch_listener(epfd);
+
+    while (1) {
+	if (paused && now_ms() >= resume_at) {
+	    watch_listener(epfd);
+	    paused = 0;
+	}
+	if ((n = epoll_wait(epfd, events, MAXEVENTS, paused ? PAUSE_MS : -1)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("epoll_wait error");
+	}
+	for (i = 0; i < n; i++) {
+	    if (events[i].data.ptr != NULL)
+		serve(epfd, events[i].data.ptr);
+	    else if (!paused && accept_conns(epfd, &sparefd) < 0) {
+		if (epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL) < 0)
+		    unix_error("epoll_ctl error");
+		paused = 1;
+		resume_at = now_ms() + PAUSE_MS;
+	    }
+	}
+    }
+}
+/* $end echoservere */
@@ -12,13 +12,16 @@ int main(int argc, char **argv)
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;  /* Enough space for any address */  //line:netp:echoserveri:sockaddrstorage
     char client_hostname[MAXLINE], client_port[MAXLINE];
+    listenopts_t opts;
 
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    listenopts_init(&opts);
+    if ((argc != 2 && argc != 3) ||
+	(argc == 3 && listenopts_parse(&opts, argv[2]) < 0)) {
+	fprintf(stderr, "usage: %s <port> [listen options, e.g. backlog=4096,defer=1]\n", argv[0]);
 	exit(0);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd_opts(argv[1], &opts);
     while (1) {
 	clientlen = sizeof(struct sockaddr_storage); 
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
@@ -1,10 +1,28 @@
-/* 
+/*
  * echoserverp.c - A concurrent echo server based on processes
+ *
+ *     By default the server forks a child for every connection.  With
+ *     -n it instead forks that many workers up front; each one blocks
+ *     in accept on the shared listening socket and serves connection
+ *     after connection, so a new client costs an accept rather than a
+ *     fork, exit and waitpid.  Workers ignore SIGPIPE and use the Rio
+ *     calls that return errors, so a client that resets its connection
+ *     costs only that connection.  The parent only waits for workers
+ *     to die and forks replacements; a slot whose worker died young
+ *     waits out RESPAWN_SECS on its own, without holding up the rest.
  */
 /* $begin echoserverpmain */
 #include "csapp.h"
 void echo(int connfd);
 
+#define MAXWORKERS 1024
+#define RESPAWN_SECS 1  /* A worker dying younger than this is suspect */
+#define BACKOFF_POLL_US 100000  /* Reaping interval while a slot waits */
+
+/* Pre-fork mode: pid of each slot's worker, 0 while it has none */
+static volatile pid_t workers[MAXWORKERS];
+static int nworkers;
+
 void sigchld_handler(int sig) //line:conc:echoserverp:handlerstart
 {
     while (waitpid(-1, 0, WNOHANG) > 0)
@@ -12,23 +30,158 @@ void sigchld_handler(int sig) //line:conc:echoserverp:handlerstart
     return;
 } //line:conc:echoserverp:handlerend
 
-int main(int argc, char **argv) 
+/* Pre-fork mode: take the workers down with the parent */
+void sigterm_handler(int sig)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++)
+	if (workers[i] > 0)
+	    kill(workers[i], SIGTERM);
+    _exit(0);
+}
+
+/* Pre-fork mode: echo lines until the client closes or the connection
+   fails, without echo's wrappers, which would exit the whole worker */
+static void worker_echo(int connfd)
+{
+    ssize_t n;
+    char *line;
+    riov_t rio;
+
+    rio_viewinit(&rio, connfd, RIO_BUFSIZE);
+    while ((n = rio_viewlineb(&rio, &line, MAXLINE)) > 0) {
+	printf("server received %d bytes\n", (int)n);
+	if (rio_writen(connfd, line, n) < 0)
+	    break;
+    }
+    rio_viewfree(&rio);
+}
+
+/* Fork a worker that serves connections from listenfd until it dies */
+static pid_t start_worker(int listenfd, sigset_t *prev)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    pid_t pid;
+    int connfd;
+
+    if ((pid = Fork()) != 0)
+	return pid;
+    Signal(SIGTERM, SIG_DFL);
+    Signal(SIGINT, SIG_DFL);
+    Sigprocmask(SIG_SETMASK, prev, NULL);
+    Signal(SIGPIPE, SIG_IGN);  /* A vanished client is a write error */
+    while (1) {
+	clientlen = sizeof(struct sockaddr_storage);
+	if ((connfd = accept(listenfd, (SA *) &clientaddr, &clientlen)) < 0)
+	    continue;  /* e.g. ECONNABORTED: the client has gone already */
+	worker_echo(connfd);
+	Close(connfd);
+    }
+}
+
+/* Pre-fork mode: fill slot i; SIGTERM is held off until its pid is
+   recorded, so the handler can't miss the new worker */
+static void fill_slot(int i, int listenfd)
 {
-    int listenfd, connfd;
+    sigset_t mask, prev;
+
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+    workers[i] = start_worker(listenfd, &prev);
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+}
+
+/* Pre-fork mode: keep n workers running, forever */
+static void prefork(int listenfd, int n)
+{
+    time_t started[MAXWORKERS], restart_at[MAXWORKERS];
+    pid_t pid;
+    int i, status, waiting;
+
+    Signal(SIGTERM, sigterm_handler);
+    Signal(SIGINT, sigterm_handler);
+    nworkers = n;
+    for (i = 0; i < n; i++)
+	restart_at[i] = 0;
+    while (1) {
+	/* Fill every empty slot that has waited out its back-off */
+	waiting = 0;
+	for (i = 0; i < nworkers; i++) {
+	    if (workers[i] != 0)
+		continue;
+	    if (time(NULL) < restart_at[i]) {
+		waiting = 1;
+		continue;
+	    }
+	    started[i] = time(NULL);
+	    fill_slot(i, listenfd);
+	}
+
+	/* Block for the next death, unless a slot is waiting to be filled */
+	if ((pid = waitpid(-1, &status, waiting ? WNOHANG : 0)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno != ECHILD || !waiting)
+		unix_error("waitpid error");
+	    pid = 0;  /* Every slot is empty and waiting */
+	}
+	if (pid == 0) {
+	    usleep(BACKOFF_POLL_US);
+	    continue;
+	}
+	for (i = 0; i < nworkers && workers[i] != pid; i++)
+	    ;
+	if (i == nworkers)
+	    continue;
+	if (WIFSIGNALED(status))
+	    fprintf(stderr, "worker %d killed by signal %d\n", (int)pid, WTERMSIG(status));
+	workers[i] = 0;
+	/* Don't spin forking workers that die as soon as they start */
+	restart_at[i] = started[i] + RESPAWN_SECS;
+    }
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-n workers] <port> [listen options, e.g. backlog=4096,defer=1]\n", prog);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    int listenfd, connfd, opt, n = 0;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    listenopts_t opts;
 
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(0);
+    listenopts_init(&opts);
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+	switch (opt) {
+	case 'n':
+	    if ((n = atoi(optarg)) <= 0 || n > MAXWORKERS)
+		usage(argv[0]);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
     }
+    if ((argc - optind != 1 && argc - optind != 2) ||
+	(argc - optind == 2 && listenopts_parse(&opts, argv[optind + 1]) < 0))
+	usage(argv[0]);
+
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
+    if (n > 0)
+	prefork(listenfd, n);
 
     Signal(SIGCHLD, sigchld_handler);
-    listenfd = Open_listenfd(argv[1]);
     while (1) {
-	clientlen = sizeof(struct sockaddr_storage); 
+	clientlen = sizeof(struct sockaddr_storage);
 	connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
-	if (Fork() == 0) { 
+	if (Fork() == 0) {
 	    Close(listenfd); /* Child closes its listening socket */
 	    echo(connfd);    /* Child services client */ //line:conc:echoserverp:echofun
 	    Close(connfd);   /* Child closes connection with client */ //line:conc:echoserverp:childclose
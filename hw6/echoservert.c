@@ -1,41 +1,152 @@
-/* 
+/*
  * echoservert.c - A concurrent echo server using threads
+ *
+ *     By default every connection gets a thread of its own.  With -p
+ *     a fixed pool of threads serves the connections instead, handed
+ *     over through an sbuf of -q slots, and -o picks what happens once
+ *     every thread is busy and the sbuf is full:
+ *       queue   stop accepting until a slot frees (the default)
+ *       reject  accept, tell the client the server is busy, hang up
+ *       block   accept only while a thread is free, so the waiting is
+ *               done in the kernel's listen queue, not the sbuf
+ *     Threads get STACKSIZE stacks (-s, in KB) instead of the usual
+ *     8MB, so 10,000 connections' threads need 640MB of address space
+ *     rather than 80GB, and only the pages echo touches are resident.
  */
 /* $begin echoservertmain */
 #include "csapp.h"
+#include "sbuf.h"
+
+#define STACKSIZE (64 * 1024)  /* Bytes; echo needs a few KB */
+#define QUEUESIZE 64           /* Default sbuf slots for -p */
+#define BUSYMSG   "server busy, try again later\n"
+
+enum { OVERLOAD_QUEUE, OVERLOAD_REJECT, OVERLOAD_BLOCK };
 
 void echo(int connfd);
 void *thread(void *vargp);
+void *pool_thread(void *vargp);
+
+sbuf_t sbuf;       /* Accepted connections waiting for a pool thread */
+sem_t idle;        /* -o block: pool threads free for a connection */
+int overload = OVERLOAD_QUEUE;
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-p nthreads [-q queue] [-o queue|reject|block]] [-s stackKB] "
+	    "<port> [listen options, e.g. backlog=4096,defer=1]\n", prog);
+    exit(0);
+}
 
-int main(int argc, char **argv) 
+/* Start a detached thread with attr's small stack */
+static void spawn(pthread_attr_t *attr, void *(*routine)(void *), void *arg)
 {
-    int listenfd, *connfdp;
+    pthread_t tid;
+    int rc;
+
+    if ((rc = pthread_create(&tid, attr, routine, arg)) != 0)
+	posix_error(rc, "pthread_create error");
+}
+
+int main(int argc, char **argv)
+{
+    int i, listenfd, connfd, opt, rc;
+    int nthreads = 0, queuesize = QUEUESIZE;
+    size_t stacksize = STACKSIZE;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
-    pthread_t tid; 
+    listenopts_t opts;
+    pthread_attr_t attr;
 
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(0);
+    listenopts_init(&opts);
+    while ((opt = getopt(argc, argv, "p:q:o:s:")) != -1) {
+	switch (opt) {
+	case 'p':
+	    if ((nthreads = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'q':
+	    if ((queuesize = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'o':
+	    if (!strcmp(optarg, "reject"))
+		overload = OVERLOAD_REJECT;
+	    else if (!strcmp(optarg, "block"))
+		overload = OVERLOAD_BLOCK;
+	    else if (strcmp(optarg, "queue"))
+		usage(argv[0]);
+	    break;
+	case 's':
+	    if (atoi(optarg) <= 0)
+		usage(argv[0]);
+	    stacksize = atoi(optarg) * 1024;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
     }
-    listenfd = Open_listenfd(argv[1]);
+    if ((argc - optind != 1 && argc - optind != 2) ||
+	(argc - optind == 2 && listenopts_parse(&opts, argv[optind + 1]) < 0))
+	usage(argv[0]);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((rc = pthread_attr_setstacksize(&attr, stacksize)) != 0)
+	posix_error(rc, "pthread_attr_setstacksize error");
+    Signal(SIGPIPE, SIG_IGN);  /* A rejected client may be gone already */
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
 
+    if (nthreads == 0) {
+	while (1) {
+	    clientlen=sizeof(struct sockaddr_storage);
+	    connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
+	    /* The descriptor travels in the argument itself, so there is
+	       nothing to malloc and no race on a shared variable */
+	    spawn(&attr, thread, (void *)(long)connfd);
+	}
+    }
+
+    /* Under -o block the sbuf never holds more than there are threads */
+    sbuf_init(&sbuf, overload == OVERLOAD_BLOCK ? nthreads : queuesize);
+    Sem_init(&idle, 0, nthreads);
+    for (i = 0; i < nthreads; i++)
+	spawn(&attr, pool_thread, NULL);
     while (1) {
-        clientlen=sizeof(struct sockaddr_storage);
-	connfdp = Malloc(sizeof(int)); //line:conc:echoservert:beginmalloc
-	*connfdp = Accept(listenfd, (SA *) &clientaddr, &clientlen); //line:conc:echoservert:endmalloc
-	Pthread_create(&tid, NULL, thread, connfdp);
+	if (overload == OVERLOAD_BLOCK)
+	    P(&idle);  /* Leave new connections to the listen queue */
+	clientlen=sizeof(struct sockaddr_storage);
+	connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
+	if (overload != OVERLOAD_REJECT)
+	    sbuf_insert(&sbuf, connfd);
+	else if (sbuf_tryinsert(&sbuf, connfd) < 0) {
+	    rio_writen(connfd, BUSYMSG, strlen(BUSYMSG));
+	    Close(connfd);
+	}
     }
 }
 
 /* Thread routine */
-void *thread(void *vargp) 
-{  
-    int connfd = *((int *)vargp);
-    Pthread_detach(pthread_self()); //line:conc:echoservert:detach
-    Free(vargp);                    //line:conc:echoservert:free
+void *thread(void *vargp)
+{
+    int connfd = (int)(long)vargp;
     echo(connfd);
     Close(connfd);
     return NULL;
 }
+
+/* Pool thread routine: serve connections from the sbuf forever */
+void *pool_thread(void *vargp)
+{
+    int connfd;
+
+    while (1) {
+	connfd = sbuf_remove(&sbuf);
+	echo(connfd);
+	Close(connfd);
+	if (overload == OVERLOAD_BLOCK)
+	    V(&idle);
+    }
+    return NULL;
+}
 /* $end echoservertmain */
@@ -1,5 +1,15 @@
-/* 
+/*
  * echoservert_pre.c - A prethreaded concurrent echo server
+ *
+ *     By default the main thread accepts connections and hands them
+ *     to the workers through an sbuf.  With -r every worker opens its
+ *     own SO_REUSEPORT listener on the port and accepts for itself,
+ *     so there is no accept thread for connections to queue behind;
+ *     the kernel spreads new connections across the listeners by a
+ *     hash of their addresses.  The catch is that a connection hashed
+ *     to a worker busy with a long one waits for it, even while other
+ *     workers are idle.  On SIGINT or SIGTERM it prints the total
+ *     bytes received from every client before it exits.
  */
 /* $begin echoservertpremain */
 #include "csapp.h"
@@ -8,41 +18,111 @@
 #define SBUFSIZE  16
 
 void echo_cnt(int connfd);
+long echo_cnt_total(void);
 void *thread(void *vargp);
+void *thread_reuseport(void *vargp);
+/* Linux's; <sys/socket.h> declares it only under _GNU_SOURCE, which
+   would clash with csapp.h's gai_error */
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 
 sbuf_t sbuf; /* Shared buffer of connected descriptors */
 
-int main(int argc, char **argv) 
+/* Report the grand total on the way out; Sio and echo_cnt_total are
+   async-signal-safe */
+void sigterm_handler(int sig)
 {
-    int i, listenfd, connfd;
+    Sio_puts("server received ");
+    Sio_putl(echo_cnt_total());
+    Sio_puts(" total bytes\n");
+    _exit(0);
+}
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-t nthreads] [-r] <port> [listen options, e.g. backlog=4096,defer=1]\n", prog);
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    int i, listenfd, connfd, opt, *listenfdp;
+    int nthreads = NTHREADS, reuseport = 0;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
-    pthread_t tid; 
+    listenopts_t opts;
+    pthread_t tid;
+
+    listenopts_init(&opts);
+    while ((opt = getopt(argc, argv, "t:r")) != -1) {
+	switch (opt) {
+	case 't':
+	    if ((nthreads = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'r':
+	    reuseport = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if ((argc - optind != 1 && argc - optind != 2) ||
+	(argc - optind == 2 && listenopts_parse(&opts, argv[optind + 1]) < 0))
+	usage(argv[0]);
+    Signal(SIGINT, sigterm_handler);
+    Signal(SIGTERM, sigterm_handler);
 
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(0);
+    if (reuseport) {
+	/* Open every listener before any worker runs, so a failure to
+	   share the port stops the server at once */
+	opts.reuseport = 1;
+	for (i = 0; i < nthreads; i++) {
+	    listenfdp = Malloc(sizeof(int));
+	    *listenfdp = Open_listenfd_opts(argv[optind], &opts);
+	    Pthread_create(&tid, NULL, thread_reuseport, listenfdp);
+	}
+	Pthread_exit(NULL);  /* The workers carry on without us */
     }
-    listenfd = Open_listenfd(argv[1]);
 
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
     sbuf_init(&sbuf, SBUFSIZE); //line:conc:pre:initsbuf
-    for (i = 0; i < NTHREADS; i++)  /* Create worker threads */ //line:conc:pre:begincreate
+    for (i = 0; i < nthreads; i++)  /* Create worker threads */ //line:conc:pre:begincreate
 	Pthread_create(&tid, NULL, thread, NULL);               //line:conc:pre:endcreate
 
-    while (1) { 
+    while (1) {
         clientlen = sizeof(struct sockaddr_storage);
 	connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen);
 	sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
     }
 }
 
-void *thread(void *vargp) 
-{  
-    Pthread_detach(pthread_self()); 
-    while (1) { 
+void *thread(void *vargp)
+{
+    Pthread_detach(pthread_self());
+    while (1) {
 	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */ //line:conc:pre:removeconnfd
 	echo_cnt(connfd);                /* Service client */
 	Close(connfd);
     }
 }
+
+/* Worker that accepts on its own listener instead of the sbuf */
+void *thread_reuseport(void *vargp)
+{
+    int listenfd = *((int *)vargp), connfd;
+
+    Pthread_detach(pthread_self());
+    Free(vargp);
+    while (1) {
+	/* accept4 sets close-on-exec as part of the accept.  The
+	   connection stays blocking: echo_cnt reads it with Rio. */
+	if ((connfd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC)) < 0) {
+	    if (errno == EINTR || errno == ECONNABORTED)
+		continue;
+	    unix_error("accept4 error");
+	}
+	echo_cnt(connfd);                /* Service client */
+	Close(connfd);
+    }
+}
 /* $end echoservertpremain */
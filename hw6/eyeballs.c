@@ -0,0 +1,128 @@
+/*
+ * eyeballs.c - Shows what open_clientfd_list buys when a host's first
+ *     address is a black hole.  A listener on 127.0.0.2 has its accept
+ *     queue filled and never accepts, so the kernel drops further SYNs
+ *     to it; a second listener on 127.0.0.1 answers normally.  Both
+ *     connect strategies get the list [black hole, good]: the serial
+ *     loop open_clientfd used to run waits out the black hole (capped
+ *     here with SO_SNDTIMEO), while open_clientfd_list starts the good
+ *     address CONNECT_DELAY ms later and takes whichever answers first.
+ *
+ *     usage: eyeballs [serial timeout secs]
+ */
+/* $begin eyeballs */
+#include <time.h>
+#include "csapp.h"
+
+#define SERIAL_TIMEOUT 5
+
+/* A listener bound to ip on an ephemeral port; *sa gets its address */
+static int listen_on(char *ip, int backlog, struct sockaddr_in *sa)
+{
+    socklen_t len = sizeof(*sa);
+    int fd = Socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    inet_pton(AF_INET, ip, &sa->sin_addr);
+    Bind(fd, (SA *)sa, sizeof(*sa));
+    Listen(fd, backlog);
+    if (getsockname(fd, (SA *)sa, &len) < 0)
+	unix_error("getsockname error");
+    return fd;
+}
+
+/* The loop open_clientfd ran before: each address in turn, blocking */
+static int serial_connect(struct addrinfo *listp, int timeout)
+{
+    struct timeval tv = { timeout, 0 };
+    struct addrinfo *p;
+    int fd;
+
+    for (p = listp; p; p = p->ai_next) {
+	if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+	    continue;
+	/* Linux's SYN retries run for minutes; don't wait them all out */
+	Setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+	    return fd;
+	Close(fd);
+    }
+    return -1;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(char *name, int fd, struct sockaddr_in *good, double secs)
+{
+    struct sockaddr_in peer;
+    socklen_t len = sizeof(peer);
+    char ip[INET_ADDRSTRLEN] = "none";
+
+    if (fd >= 0) {
+	if (getpeername(fd, (SA *)&peer, &len) < 0)
+	    unix_error("getpeername error");
+	inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+    }
+    printf("%-20s %8.1f ms  -> %s%s\n", name, secs * 1000, ip,
+	   fd >= 0 && peer.sin_port == good->sin_port ? " (good)" : "");
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in hole, good;
+    struct addrinfo ai[2];
+    int holefd, goodfd, fillfd[4], i, fd, timeout = SERIAL_TIMEOUT;
+    double start;
+
+    if (argc > 1 && (timeout = atoi(argv[1])) <= 0) {
+	fprintf(stderr, "usage: %s [serial timeout secs]\n", argv[0]);
+	exit(1);
+    }
+
+    /* The black hole: a full accept queue that is never drained */
+    holefd = listen_on("127.0.0.2", 0, &hole);
+    for (i = 0; i < 4; i++) {
+	fillfd[i] = Socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	connect(fillfd[i], (SA *)&hole, sizeof(hole));
+    }
+    usleep(100000);  /* Let the handshakes that will complete, complete */
+    goodfd = listen_on("127.0.0.1", LISTENQ, &good);
+
+    /* What getaddrinfo might return for a host with a dead first address */
+    memset(ai, 0, sizeof(ai));
+    ai[0].ai_family = ai[1].ai_family = AF_INET;
+    ai[0].ai_socktype = ai[1].ai_socktype = SOCK_STREAM;
+    ai[0].ai_addr = (SA *)&hole;
+    ai[1].ai_addr = (SA *)&good;
+    ai[0].ai_addrlen = ai[1].ai_addrlen = sizeof(struct sockaddr_in);
+    ai[0].ai_next = &ai[1];
+
+    printf("black hole 127.0.0.2:%d, good 127.0.0.1:%d, CONNECT_DELAY %d ms\n",
+	   ntohs(hole.sin_port), ntohs(good.sin_port), CONNECT_DELAY);
+
+    start = now();
+    fd = serial_connect(ai, timeout);
+    report("serial", fd, &good, now() - start);
+    if (fd >= 0)
+	Close(fd);
+
+    start = now();
+    fd = open_clientfd_list(ai);
+    report("open_clientfd_list", fd, &good, now() - start);
+    if (fd >= 0)
+	Close(fd);
+
+    for (i = 0; i < 4; i++)
+	Close(fillfd[i]);
+    Close(holefd);
+    Close(goodfd);
+    exit(0);
+}
+/* $end eyeballs */
@@ -0,0 +1,190 @@
+/*
+ * riobench.c - Times rio_readlineb over multi-megabyte streams of lines
+ *     of several lengths, against the original byte-at-a-time version
+ *     (kept below as old_rio_readlineb) and the zero-copy
+ *     rio_viewlineb, and checks all three read the same bytes.  The stream is a temporary file, so read() is served from
+ *     the page cache and the numbers are mostly Rio's own cost.
+ *
+ *     usage: riobench [megabytes] [line length...]
+ *     e.g.   riobench 64 8 80 1024 16384
+ */
+/* $begin riobench */
+#include <time.h>
+#include "csapp.h"
+
+#define MEGABYTES 64
+#define MAXLINELEN (MAXLINE * 4)
+
+/* The original rio_read and rio_readlineb, for comparison */
+static ssize_t old_rio_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
+			   sizeof(rp->rio_buf));
+	if (rp->rio_cnt < 0) {
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return -1;
+	}
+	else if (rp->rio_cnt == 0)  /* EOF */
+	    return 0;
+	else
+	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+    }
+    cnt = n;
+    if (rp->rio_cnt < n)
+	cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+static ssize_t old_rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = old_rio_read(rp, &c, 1)) == 1) {
+	    *bufp++ = c;
+	    if (c == '\n') {
+                n++;
+     		break;
+            }
+	} else if (rc == 0) {
+	    if (n == 1)
+		return 0; /* EOF, no data read */
+	    else
+		break;    /* EOF, some data was read */
+	} else
+	    return -1;	  /* Error */
+    }
+    *bufp = 0;
+    return n-1;
+}
+
+/* Fill fd with about nbytes of linelen-byte lines (newline included) */
+static size_t make_stream(int fd, size_t nbytes, size_t linelen)
+{
+    char *buf = Malloc(MAXBUF + MAXLINELEN);
+    size_t i, total = 0, len = 0;
+
+    while (total < nbytes) {
+	for (i = 0; i < linelen - 1; i++)
+	    buf[len++] = 'a' + (total + i) % 26;
+	buf[len++] = '\n';
+	total += linelen;
+	if (len >= MAXBUF || total >= nbytes) {
+	    Rio_writen(fd, buf, len);
+	    len = 0;
+	}
+    }
+    Free(buf);
+    return total;
+}
+
+/* rio_viewlineb through a 64KB view buffer, for time_view */
+static double time_view(int fd, size_t *nlines, size_t *nbytes, unsigned *sum)
+{
+    struct timespec start, end;
+    riov_t rio;
+    char *line;
+    ssize_t n;
+
+    Lseek(fd, 0, SEEK_SET);
+    rio_viewinit(&rio, fd, 65536);
+    *nlines = *nbytes = *sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((n = rio_viewlineb(&rio, &line, MAXLINELEN)) > 0) {
+	(*nlines)++;
+	*nbytes += n;
+	*sum = *sum * 31 + (unsigned char)line[n / 2];
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rio_viewfree(&rio);
+    if (n < 0)
+	unix_error("rio_viewlineb error");
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* Read fd from the start a line at a time; returns seconds taken */
+static double time_reader(int fd, ssize_t (*readline)(rio_t *, void *, size_t),
+			  size_t *nlines, size_t *nbytes, unsigned *sum)
+{
+    static char line[MAXLINELEN];
+    struct timespec start, end;
+    rio_t rio;
+    ssize_t n;
+
+    Lseek(fd, 0, SEEK_SET);
+    Rio_readinitb(&rio, fd);
+    *nlines = *nbytes = *sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((n = readline(&rio, line, sizeof(line))) > 0) {
+	(*nlines)++;
+	*nbytes += n;
+	*sum = *sum * 31 + (unsigned char)line[n / 2];  /* Touch the data */
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (n < 0)
+	unix_error("readline error");
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    static size_t default_lens[] = { 8, 80, 1024, 16384 };
+    size_t megabytes = MEGABYTES, linelen, total;
+    size_t oldlines, oldbytes, newlines, newbytes, viewlines, viewbytes;
+    unsigned oldsum, newsum, viewsum;
+    double oldsec, newsec, viewsec;
+    char tmpname[] = "/tmp/riobenchXXXXXX";
+    int i, fd, nlens, status = 0;
+
+    if (argc > 1 && (megabytes = atoi(argv[1])) == 0) {
+	fprintf(stderr, "usage: %s [megabytes] [line length...]\n", argv[0]);
+	exit(1);
+    }
+    nlens = argc > 2 ? argc - 2 : sizeof(default_lens) / sizeof(default_lens[0]);
+
+    printf("%8s %10s %10s %10s %10s %12s %12s %12s\n", "line", "lines",
+	   "old MB/s", "new MB/s", "view MB/s",
+	   "old ns/line", "new ns/line", "view ns/line");
+    for (i = 0; i < nlens; i++) {
+	linelen = argc > 2 ? atoi(argv[i + 2]) : default_lens[i];
+	if (linelen < 1 || linelen > MAXLINELEN - 1) {
+	    fprintf(stderr, "line length must be 1..%d\n", MAXLINELEN - 1);
+	    exit(1);
+	}
+	if ((fd = mkstemp(tmpname)) < 0)
+	    unix_error("mkstemp error");
+	unlink(tmpname);
+	strcpy(tmpname + strlen(tmpname) - 6, "XXXXXX");
+	total = make_stream(fd, megabytes << 20, linelen);
+
+	/* Once untimed, so both runs start from a warm page cache */
+	time_reader(fd, rio_readlineb, &newlines, &newbytes, &newsum);
+	oldsec = time_reader(fd, old_rio_readlineb, &oldlines, &oldbytes, &oldsum);
+	newsec = time_reader(fd, rio_readlineb, &newlines, &newbytes, &newsum);
+	viewsec = time_view(fd, &viewlines, &viewbytes, &viewsum);
+	Close(fd);
+
+	if (oldlines != newlines || oldbytes != newbytes || oldbytes != total ||
+	    oldsum != newsum || viewlines != oldlines || viewbytes != oldbytes ||
+	    viewsum != oldsum) {
+	    printf("%8zu MISMATCH: old %zu lines/%zu bytes, new %zu/%zu, view %zu/%zu\n",
+		   linelen, oldlines, oldbytes, newlines, newbytes,
+		   viewlines, viewbytes);
+	    status = 1;
+	    continue;
+	}
+	printf("%8zu %10zu %10.1f %10.1f %10.1f %12.1f %12.1f %12.1f\n",
+	       linelen, newlines, total / oldsec / 1e6, total / newsec / 1e6,
+	       total / viewsec / 1e6, oldsec * 1e9 / oldlines,
+	       newsec * 1e9 / newlines, viewsec * 1e9 / viewlines);
+    }
+    exit(status);
+}
+/* $end riobench */
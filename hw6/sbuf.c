@@ -35,6 +35,22 @@ void sbuf_insert(sbuf_t *sp, int item)
 }
 /* $end sbuf_insert */
 
+/* Insert item onto the rear of sp unless it is full; returns 0, or
+   -1 if there was no slot */
+/* $begin sbuf_tryinsert */
+int sbuf_tryinsert(sbuf_t *sp, int item)
+{
+    while (sem_trywait(&sp->slots) < 0)     /* Take a slot if there is one */
+	if (errno != EINTR)
+	    return -1;
+    P(&sp->mutex);                          /* Lock the buffer */
+    sp->buf[(++sp->rear)%(sp->n)] = item;   /* Insert the item */
+    V(&sp->mutex);                          /* Unlock the buffer */
+    V(&sp->items);                          /* Announce available item */
+    return 0;
+}
+/* $end sbuf_tryinsert */
+
 /* Remove and return the first item from buffer sp */
 /* $begin sbuf_remove */
 int sbuf_remove(sbuf_t *sp)
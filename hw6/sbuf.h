@@ -18,6 +18,7 @@ typedef struct {
 void sbuf_init(sbuf_t *sp, int n);
 void sbuf_deinit(sbuf_t *sp);
 void sbuf_insert(sbuf_t *sp, int item);
+int sbuf_tryinsert(sbuf_t *sp, int item);
 int sbuf_remove(sbuf_t *sp);
 
 #endif /* __SBUF_H__ */
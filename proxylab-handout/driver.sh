@@ -131,8 +131,8 @@ function clear_dirs {
 #
 function wait_for_port_use() {
     timeout_count="0"
-    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
-        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+    portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+        | grep tcp | awk '{print $4}' | sed 's/.*://' \
         | grep -E "[0-9]+" | uniq | tr "\n" " "`
 
     echo "${portsinuse}" | grep -wq "${1}"
@@ -144,8 +144,8 @@ function wait_for_port_use() {
         fi
 
         sleep 1
-        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
-            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
             | grep -E "[0-9]+" | uniq | tr "\n" " "`
         echo "${portsinuse}" | grep -wq "${1}"
     done
@@ -163,8 +163,8 @@ function free_port {
 
     while [ TRUE ] 
     do
-        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
-            | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
             | grep -E "[0-9]+" | uniq | tr "\n" " "`
 
         echo "${portsinuse}" | grep -wq "${port}"
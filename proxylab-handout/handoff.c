@@ -0,0 +1,141 @@
+#include <poll.h>
+
+#include "handoff.h"
+
+#define HANDOFF_ACK_TIMEOUT 5000 // ms the old process waits for the new one
+
+// send fd over the Unix socket sock as SCM_RIGHTS ancillary data
+int handoff_send_fd(int sock, int fd)
+{
+    char byte = 'F';
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) != 1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// receive a descriptor sent by handoff_send_fd, or -1 on error
+int handoff_recv_fd(int sock)
+{
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union
+    {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, 0) != 1)
+    {
+        return -1;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        return -1;
+    }
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+// fork and exec a fresh copy of the proxy (argv[0] is re-read from disk, so
+// this also picks up a new binary).  The child gets one end of a Unix
+// socketpair as fd 3 and nothing else; the other end is returned in *sockp.
+pid_t handoff_spawn(char **argv, int *sockp)
+{
+    int sv[2], fd, maxfd;
+    pid_t pid;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    {
+        return -1;
+    }
+    if ((pid = fork()) < 0)
+    {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // don't leak client/server connections into the new process
+        if (dup2(sv[1], 3) < 0)
+        {
+            _exit(1);
+        }
+        maxfd = sysconf(_SC_OPEN_MAX);
+        for (fd = 4; fd < maxfd; fd++)
+        {
+            close(fd);
+        }
+        setenv(HANDOFF_ENV, "3", 1);
+        execv(argv[0], argv);
+        _exit(1);
+    }
+    close(sv[1]);
+    *sockp = sv[0];
+    return pid;
+}
+
+// the handoff socket passed by our parent, or -1 if we were started normally
+int handoff_inherited_sock(void)
+{
+    char *s = getenv(HANDOFF_ENV);
+    if (s == NULL)
+    {
+        return -1;
+    }
+    unsetenv(HANDOFF_ENV); // don't pass it on to our own reloads
+    return atoi(s);
+}
+
+// tell the old process we are accepting on the listening socket
+int handoff_ack(int sock)
+{
+    char byte = 'A';
+    return write(sock, &byte, 1) == 1 ? 0 : -1;
+}
+
+int handoff_wait_ack(int sock)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    char byte;
+
+    if (poll(&pfd, 1, HANDOFF_ACK_TIMEOUT) != 1)
+    {
+        return -1;
+    }
+    return read(sock, &byte, 1) == 1 && byte == 'A' ? 0 : -1;
+}
@@ -0,0 +1,673 @@
+/*
+ * loadgen.c - open-loop HTTP load generator for the proxy and tiny
+ *
+ * Requests are issued on a fixed schedule (rate per second), not when the
+ * previous one finishes, and latency is measured from the time a request
+ * was *scheduled*.  A slow server therefore shows up as higher latency
+ * instead of silently lowering the offered load (coordinated omission).
+ * With -r 0 it runs closed-loop instead, to find peak throughput: each
+ * connection sends its next request as soon as the last one completes.
+ *
+ * usage: loadgen [-p proxyhost:port] [-r rate] [-d seconds] [-c conns] [-k] url...
+ *     -p  send absolute-URI requests through this proxy
+ *     -r  requests per second (default 1000), 0 for closed-loop; at most
+ *         MAX_RATE, since latencies are kept in microseconds
+ *     -d  test duration in seconds (default 10)
+ *     -c  maximum concurrent connections (default 1000); closed-loop,
+ *         the number of requests kept in flight
+ *     -k  keep connections alive between requests (HTTP/1.1)
+ *     url http://host:port/path, cycled through round-robin
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define MAXEVENTS 256
+#define MAXURLS 64
+#define REQ_SIZE 1024
+#define RESP_HDR_SIZE 8192
+#define DRAIN_USEC 5000000 // how long to wait for stragglers after the run
+#define MAX_RATE 1000000   // one request per microsecond, the latency resolution
+
+enum conn_states
+{
+    CONN_FREE,
+    CONN_CONNECTING,
+    CONN_WRITING,
+    CONN_READING,
+    CONN_IDLE // keep-alive connection waiting for its next request
+};
+
+typedef struct
+{
+    char host[256];
+    char port[16];
+    char request[REQ_SIZE]; // the full request, ready to write
+    int request_len;
+    struct addrinfo *addr; // where to connect (origin or proxy)
+} target_t;
+
+typedef struct
+{
+    int fd;
+    enum conn_states state;
+    int target;          // index into targets
+    uint64_t scheduled;  // when the current request should have started
+    int written;         // request bytes written
+    char hdr[RESP_HDR_SIZE];
+    int hdr_len;         // response header bytes buffered so far
+    int hdr_done;        // saw the blank line
+    long content_length; // -1 if the response had none
+    long body_read;
+    int status;
+    int reusable;     // server will keep the connection open afterwards
+    int in_idle_list; // already on idle_list (possibly stale)
+} conn_t;
+
+target_t targets[MAXURLS];
+int ntargets = 0;
+conn_t *conns;
+int maxconns = 1000;
+int busy = 0;          // connections with a request in progress
+int *free_list, nfree; // conns[] slots with no socket
+int *idle_list, nidle; // keep-alive connections waiting for a request
+int keepalive = 0;
+int closed_loop = 0; // -r 0: keep maxconns requests in flight
+int efd;
+
+// scheduled-but-unissued requests, waiting for a free connection
+uint64_t *backlog;
+int backlog_head = 0, backlog_tail = 0, backlog_cap;
+
+// results
+uint32_t *latencies; // usec, one per completed request
+long nlatencies = 0, latency_cap;
+long completed = 0, errors = 0, bad_status = 0, issued = 0;
+long bytes_read = 0;
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t now_usec(void)
+{
+    return now_nsec() / 1000;
+}
+
+// split http://host[:port]/path
+static int parse_url(char *url, char *host, char *port, char **path)
+{
+    char *p, *slash, *colon;
+
+    if (strncmp(url, "http://", 7) != 0)
+    {
+        return -1;
+    }
+    p = url + 7;
+    slash = strchr(p, '/');
+    *path = slash ? slash : "/";
+    int hostlen = slash ? slash - p : (int)strlen(p);
+    if (hostlen >= 256)
+    {
+        return -1;
+    }
+    memcpy(host, p, hostlen);
+    host[hostlen] = '\0';
+    strcpy(port, "80");
+    if ((colon = strchr(host, ':')) != NULL)
+    {
+        *colon = '\0';
+        snprintf(port, 16, "%s", colon + 1);
+    }
+    return 0;
+}
+
+static struct addrinfo *resolve(char *host, char *port)
+{
+    struct addrinfo hints, *result;
+    int s;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((s = getaddrinfo(host, port, &hints, &result)) != 0)
+    {
+        fprintf(stderr, "getaddrinfo %s:%s: %s\n", host, port, gai_strerror(s));
+        exit(1);
+    }
+    return result;
+}
+
+static void add_target(char *url, char *proxy)
+{
+    target_t *t = &targets[ntargets++];
+    char *path;
+    char phost[256], pport[16], request[REQ_SIZE];
+
+    if (parse_url(url, t->host, t->port, &path) < 0)
+    {
+        fprintf(stderr, "bad url: %s\n", url);
+        exit(1);
+    }
+    t->request_len = snprintf(request, REQ_SIZE,
+                              "GET %s HTTP/1.%d\r\nHost: %s:%s\r\nConnection: %s\r\n\r\n",
+                              proxy ? url : path, keepalive, t->host, t->port,
+                              keepalive ? "keep-alive" : "close");
+    memcpy(t->request, request, REQ_SIZE);
+    if (proxy)
+    {
+        snprintf(phost, sizeof(phost), "%s", proxy);
+        char *colon = strrchr(phost, ':');
+        if (colon == NULL)
+        {
+            fprintf(stderr, "proxy must be host:port\n");
+            exit(1);
+        }
+        *colon = '\0';
+        snprintf(pport, sizeof(pport), "%s", colon + 1);
+        t->addr = resolve(phost, pport);
+    }
+    else
+    {
+        t->addr = resolve(t->host, t->port);
+    }
+}
+
+static void conn_watch(conn_t *c, int op, uint32_t events)
+{
+    struct epoll_event event;
+    event.data.ptr = c;
+    event.events = events;
+    if (epoll_ctl(efd, op, c->fd, &event) < 0)
+    {
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+static void conn_close(conn_t *c)
+{
+    close(c->fd); // also removes it from the epoll set
+    c->fd = -1;
+    c->state = CONN_FREE;
+    free_list[nfree++] = c - conns;
+}
+
+static void record(conn_t *c)
+{
+    uint64_t latency = now_usec() - c->scheduled;
+    if (nlatencies == latency_cap && closed_loop)
+    {
+        // no schedule to size it by, so grow as we go
+        latency_cap *= 2;
+        latencies = realloc(latencies, sizeof(uint32_t) * latency_cap);
+    }
+    if (nlatencies < latency_cap)
+    {
+        latencies[nlatencies++] = latency > UINT32_MAX ? UINT32_MAX : latency;
+    }
+    completed++;
+    busy--;
+    if (c->status < 200 || c->status > 299)
+    {
+        bad_status++;
+    }
+}
+
+// start the request scheduled at time `scheduled` on connection c
+static void start_request(conn_t *c, uint64_t scheduled)
+{
+    c->target = issued++ % ntargets;
+    busy++;
+    c->scheduled = scheduled;
+    c->written = 0;
+    c->hdr_len = 0;
+    c->hdr_done = 0;
+    c->content_length = -1;
+    c->body_read = 0;
+    c->status = 0;
+    c->reusable = 0;
+}
+
+// the request on c failed: count it and drop the connection
+static void fail(conn_t *c)
+{
+    errors++;
+    busy--;
+    conn_close(c);
+}
+
+static int open_conn(conn_t *c, uint64_t scheduled)
+{
+    start_request(c, scheduled);
+    struct addrinfo *ai = targets[c->target].addr;
+    c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+    if (c->fd < 0)
+    {
+        errors++;
+        busy--;
+        free_list[nfree++] = c - conns;
+        return -1;
+    }
+    if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        fail(c);
+        return -1;
+    }
+    c->state = CONN_CONNECTING;
+    conn_watch(c, EPOLL_CTL_ADD, EPOLLOUT);
+    return 0;
+}
+
+// issue one scheduled request, reusing an idle keep-alive connection if we can
+static int issue(uint64_t scheduled)
+{
+    conn_t *c = NULL;
+
+    while (nidle > 0)
+    {
+        c = &conns[idle_list[--nidle]];
+        c->in_idle_list = 0;
+        if (c->state == CONN_IDLE) // skip ones the server has since closed
+        {
+            start_request(c, scheduled);
+            c->state = CONN_WRITING;
+            conn_watch(c, EPOLL_CTL_MOD, EPOLLOUT);
+            return 0;
+        }
+    }
+    if (nfree == 0)
+    {
+        return -1; // caller queues it
+    }
+    c = &conns[free_list[--nfree]];
+    open_conn(c, scheduled);
+    return 0;
+}
+
+static void backlog_push(uint64_t scheduled)
+{
+    if (backlog_tail - backlog_head == backlog_cap)
+    {
+        errors++; // hopelessly behind, drop it
+        return;
+    }
+    backlog[backlog_tail++ % backlog_cap] = scheduled;
+}
+
+// issue as many queued requests as free connections allow
+static void backlog_drain(void)
+{
+    while (backlog_head != backlog_tail)
+    {
+        if (issue(backlog[backlog_head % backlog_cap]) < 0)
+        {
+            return;
+        }
+        backlog_head++;
+    }
+}
+
+// parse the status line and Content-length once the headers are complete
+static void parse_headers(conn_t *c, char *end)
+{
+    char *p;
+    int minor = 0;
+
+    c->hdr_done = 1;
+    *end = '\0';
+    sscanf(c->hdr, "HTTP/1.%d %d", &minor, &c->status);
+    c->reusable = minor >= 1; // HTTP/1.1 defaults to persistent
+    for (p = strstr(c->hdr, "\r\n"); p != NULL; p = strstr(p + 2, "\r\n"))
+    {
+        if (strncasecmp(p + 2, "Content-length:", 15) == 0)
+        {
+            c->content_length = atol(p + 17);
+        }
+        else if (strncasecmp(p + 2, "Connection:", 11) == 0)
+        {
+            char *v = p + 13;
+            while (*v == ' ')
+                v++;
+            c->reusable = strncasecmp(v, "close", 5) != 0;
+        }
+    }
+}
+
+// the response on c is complete: record it and reuse or close the connection
+static void finish(conn_t *c)
+{
+    record(c);
+    if (keepalive && c->reusable && c->content_length >= 0)
+    {
+        c->state = CONN_IDLE;
+        conn_watch(c, EPOLL_CTL_MOD, EPOLLIN | EPOLLRDHUP);
+        if (!c->in_idle_list)
+        {
+            c->in_idle_list = 1;
+            idle_list[nidle++] = c - conns;
+        }
+    }
+    else
+    {
+        conn_close(c);
+    }
+    backlog_drain();
+}
+
+static void on_readable(conn_t *c)
+{
+    char buf[65536];
+    ssize_t n;
+
+    if (c->state == CONN_IDLE)
+    {
+        conn_close(c); // server closed an idle keep-alive connection
+        backlog_drain();
+        return;
+    }
+    while ((n = read(c->fd, buf, sizeof(buf))) > 0)
+    {
+        char *body = buf;
+        bytes_read += n;
+        if (!c->hdr_done)
+        {
+            int room = RESP_HDR_SIZE - 1 - c->hdr_len;
+            int take = n < room ? n : room;
+            memcpy(c->hdr + c->hdr_len, buf, take);
+            c->hdr_len += take;
+            c->hdr[c->hdr_len] = '\0';
+            char *end = strstr(c->hdr, "\r\n\r\n");
+            if (end == NULL)
+            {
+                continue;
+            }
+            // whatever followed the blank line is body
+            int hdr_bytes = end + 4 - c->hdr;
+            body = buf + (hdr_bytes - (c->hdr_len - take));
+            n -= body - buf;
+            parse_headers(c, end);
+        }
+        c->body_read += n;
+        if (c->content_length >= 0 && c->body_read >= c->content_length && keepalive)
+        {
+            finish(c);
+            return;
+        }
+    }
+    if (n == 0)
+    {
+        // EOF: the whole response for Connection: close
+        if (c->hdr_done)
+        {
+            c->content_length = -1; // don't reuse
+            finish(c);
+        }
+        else
+        {
+            fail(c);
+            backlog_drain();
+        }
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        fail(c);
+        backlog_drain();
+    }
+}
+
+static void on_writable(conn_t *c)
+{
+    target_t *t = &targets[c->target];
+    ssize_t n;
+
+    if (c->state == CONN_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0)
+        {
+            fail(c);
+            backlog_drain();
+            return;
+        }
+        c->state = CONN_WRITING;
+    }
+    while (c->written < t->request_len)
+    {
+        n = write(c->fd, t->request + c->written, t->request_len - c->written);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            fail(c);
+            backlog_drain();
+            return;
+        }
+        c->written += n;
+    }
+    c->state = CONN_READING;
+    conn_watch(c, EPOLL_CTL_MOD, EPOLLIN);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p)
+{
+    if (nlatencies == 0)
+    {
+        return 0;
+    }
+    long i = (long)(p / 100.0 * nlatencies);
+    if (i >= nlatencies)
+    {
+        i = nlatencies - 1;
+    }
+    return latencies[i] / 1000.0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-p proxyhost:port] [-r rate] [-d seconds] [-c conns] [-k] url...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *proxy = NULL;
+    double rate = 1000;
+    double duration = 10;
+    struct epoll_event events[MAXEVENTS];
+    struct rlimit rl;
+    int opt, i, n;
+
+    while ((opt = getopt(argc, argv, "p:r:d:c:k")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            proxy = optarg;
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'c':
+            maxconns = atoi(optarg);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind == argc || rate < 0 || duration <= 0 || maxconns <= 0)
+    {
+        usage(argv[0]);
+    }
+    if (rate > MAX_RATE)
+    {
+        fprintf(stderr, "rate %.0f/s is too high to pace, at most %d/s\n", rate, MAX_RATE);
+        exit(1);
+    }
+    for (i = optind; i < argc && ntargets < MAXURLS; i++)
+    {
+        add_target(argv[i], proxy);
+    }
+
+    // thousands of sockets need more than the default 1024 descriptors
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)maxconns + 16 > rl.rlim_cur)
+    {
+        maxconns = rl.rlim_cur - 16;
+        fprintf(stderr, "descriptor limit: using at most %d connections\n", maxconns);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    closed_loop = rate == 0;
+    long total = closed_loop ? 0 : (long)(rate * duration);
+    conns = calloc(maxconns, sizeof(conn_t));
+    free_list = malloc(sizeof(int) * maxconns);
+    idle_list = malloc(sizeof(int) * maxconns);
+    nfree = nidle = 0;
+    for (i = maxconns - 1; i >= 0; i--)
+    {
+        conns[i].fd = -1;
+        free_list[nfree++] = i;
+    }
+    latency_cap = closed_loop ? 65536 : total;
+    latencies = malloc(sizeof(uint32_t) * (latency_cap + 1));
+    backlog_cap = total + 1;
+    backlog = malloc(sizeof(uint64_t) * backlog_cap);
+    if ((efd = epoll_create1(0)) < 0)
+    {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    // the schedule is kept in nanoseconds and each slot computed from the
+    // start, so a rate that doesn't divide a second evenly doesn't drift
+    uint64_t start_ns = now_nsec();
+    uint64_t start = start_ns / 1000;
+    uint64_t end = start + (uint64_t)(duration * 1000000);
+    long scheduled = 0;
+
+    while (1)
+    {
+        uint64_t now_ns = now_nsec();
+        uint64_t now = now_ns / 1000;
+
+        // issue everything whose time has come
+        while (scheduled < total && start_ns + (uint64_t)(scheduled * 1e9 / rate) <= now_ns)
+        {
+            uint64_t when = (start_ns + (uint64_t)(scheduled * 1e9 / rate)) / 1000;
+            if (backlog_head != backlog_tail || issue(when) < 0)
+            {
+                backlog_push(when);
+            }
+            scheduled++;
+        }
+        // closed-loop: top up to maxconns in flight until time is up
+        if (closed_loop && now < end)
+        {
+            for (int want = maxconns - busy; want > 0; want--)
+            {
+                if (issue(now) < 0)
+                {
+                    break;
+                }
+            }
+        }
+        else if (closed_loop && busy == 0)
+        {
+            break;
+        }
+        if (scheduled == total && backlog_head == backlog_tail && busy == 0 && !closed_loop)
+        {
+            break;
+        }
+        if (now > end + DRAIN_USEC)
+        {
+            break; // give up on stragglers
+        }
+
+        int timeout = closed_loop ? 10 : 100;
+        if (scheduled < total)
+        {
+            uint64_t next = start_ns + (uint64_t)(scheduled * 1e9 / rate);
+            timeout = next > now_ns ? (int)((next - now_ns + 999999) / 1000000) : 0;
+        }
+        if ((n = epoll_wait(efd, events, MAXEVENTS, timeout)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (i = 0; i < n; i++)
+        {
+            conn_t *c = events[i].data.ptr;
+            if (c->state == CONN_FREE)
+            {
+                continue; // closed earlier in this batch
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR) &&
+                c->state != CONN_CONNECTING && c->state != CONN_WRITING)
+            {
+                on_readable(c);
+            }
+            else if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            {
+                on_writable(c);
+            }
+        }
+    }
+
+    double elapsed = (now_usec() - start) / 1e6;
+    long unfinished = busy + (backlog_tail - backlog_head);
+    qsort(latencies, nlatencies, sizeof(uint32_t), cmp_u32);
+
+    if (closed_loop)
+    {
+        printf("requests:    closed-loop, %d in flight for %.1fs%s\n",
+               maxconns, duration, keepalive ? ", keep-alive" : "");
+    }
+    else
+    {
+        printf("requests:    %ld scheduled at %.0f/s for %.1fs, %d max connections%s\n",
+               total, rate, duration, maxconns, keepalive ? ", keep-alive" : "");
+    }
+    printf("completed:   %ld (%ld non-2xx), %ld errors, %ld unfinished\n",
+           completed, bad_status, errors, unfinished);
+    printf("throughput:  %.1f req/s, %.2f MB/s\n", completed / elapsed, bytes_read / elapsed / 1e6);
+    printf("latency ms:  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           percentile(50), percentile(90), percentile(99), percentile(99.9),
+           nlatencies ? latencies[nlatencies - 1] / 1000.0 : 0.0);
+    return errors || unfinished ? 2 : 0;
+}
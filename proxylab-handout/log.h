@@ -0,0 +1,39 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// Statements above this level are compiled out entirely, arguments and
+// all.  Release builds keep INFO; "make DEBUG=1" compiles in LOG_DEBUG.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Environment variable naming the runtime level: error, warn, info, debug
+#define LOG_ENV "PROXY_LOG"
+
+extern int log_level; // runtime verbosity, read with a relaxed atomic load
+
+#define LOG_ENABLED(level) \
+    ((level) <= LOG_COMPILE_LEVEL && (level) <= __atomic_load_n(&log_level, __ATOMIC_RELAXED))
+
+#define LOG_AT(level, ...)                \
+    do                                    \
+    {                                     \
+        if (LOG_ENABLED(level))           \
+            log_write(level, __VA_ARGS__); \
+    } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+void log_init(void);
+void log_set_level(int level);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* __LOG_H__ */
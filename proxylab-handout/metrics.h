@@ -0,0 +1,140 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_MAX_THREADS 64 // threads past this share the last slot
+#define METRICS_CACHE_LINE 64
+#define METRICS_SUB_BITS 2 // 4 log-linear sub-buckets per power of two
+#define METRICS_NBUCKETS ((32 - 1) << METRICS_SUB_BITS)
+#define METRICS_BUFSIZE 65536 // enough for the whole exposition text
+
+enum metric_counter
+{
+    M_CONNECTIONS,       // client connections accepted
+    M_REQUESTS,          // requests answered
+    M_ERRORS,            // requests abandoned
+    M_BYTES_FROM_CLIENT, // bytes relayed in each direction
+    M_BYTES_TO_SERVER,
+    M_BYTES_FROM_SERVER,
+    M_BYTES_TO_CLIENT,
+    M_CACHE_HITS,
+    M_CACHE_MISSES,
+    M_CACHE_EVICTIONS,
+    M_NCOUNTERS
+};
+
+// connections currently in each request state
+enum metric_gauge
+{
+    G_READ_CLIENT,
+    G_WRITE_SERVER,
+    G_READ_SERVER,
+    G_WRITE_CLIENT,
+    G_NGAUGES
+};
+
+enum metric_hist
+{
+    H_REQUEST_USEC,  // accept to last byte written to the client
+    H_UPSTREAM_USEC, // connect to the origin until its response is read
+    H_NHISTS
+};
+
+// One per thread and written only by that thread, so updates are plain
+// loads and stores on a line nobody else writes.  Readers sum every slot.
+typedef struct
+{
+    uint64_t counters[M_NCOUNTERS];
+    int64_t gauges[G_NGAUGES];
+    uint64_t hist[H_NHISTS][METRICS_NBUCKETS];
+    uint64_t hist_sum[H_NHISTS];
+    int shared; // overflow slot, updated with atomic adds instead
+} __attribute__((aligned(METRICS_CACHE_LINE))) metrics_slot_t;
+
+// callback that appends application-specific lines at scrape time
+typedef int (*metrics_extra_fn)(char *buf, int size);
+
+extern __thread metrics_slot_t *metrics_my_slot;
+metrics_slot_t *metrics_register(void);
+int metrics_format(char *buf, int size, metrics_extra_fn extra);
+int metrics_admin_start(char *port, metrics_extra_fn extra);
+void metrics_admin_stop(void);
+
+static inline metrics_slot_t *metrics_self(void)
+{
+    metrics_slot_t *slot = metrics_my_slot;
+    return slot ? slot : metrics_register();
+}
+
+static inline void metrics_add_u64(metrics_slot_t *slot, uint64_t *p, uint64_t v)
+{
+    if (slot->shared)
+    {
+        __atomic_fetch_add(p, v, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void metrics_inc(enum metric_counter c, uint64_t v)
+{
+    metrics_slot_t *slot = metrics_self();
+    metrics_add_u64(slot, &slot->counters[c], v);
+}
+
+static inline void metrics_gauge_add(enum metric_gauge g, int64_t v)
+{
+    metrics_slot_t *slot = metrics_self();
+    metrics_add_u64(slot, (uint64_t *)&slot->gauges[g], (uint64_t)v);
+}
+
+// move a connection from one state gauge to another, -1 for none
+static inline void metrics_transition(int from, int to)
+{
+    if (from >= 0)
+    {
+        metrics_gauge_add(from, -1);
+    }
+    if (to >= 0)
+    {
+        metrics_gauge_add(to, 1);
+    }
+}
+
+// HDR-style bucket: exact below 4, then 4 linear steps per power of two
+static inline int metrics_bucket(uint64_t v)
+{
+    int msb;
+
+    if (v < (1 << METRICS_SUB_BITS))
+    {
+        return (int)v;
+    }
+    if (v >= (1ULL << 31))
+    {
+        return METRICS_NBUCKETS - 1;
+    }
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+           (int)((v >> (msb - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+}
+
+static inline void metrics_observe(enum metric_hist h, uint64_t usec)
+{
+    metrics_slot_t *slot = metrics_self();
+    metrics_add_u64(slot, &slot->hist[h][metrics_bucket(usec)], 1);
+    metrics_add_u64(slot, &slot->hist_sum[h], usec);
+}
+
+static inline uint64_t metrics_now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif /* __METRICS_H__ */
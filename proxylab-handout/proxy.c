@@ -5,22 +5,31 @@
 #include <stdio.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <string.h>
 
 #include "csapp.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "log.h"
 
 #define MAXEVENTS 64
 #define REQ_ARRAY_SIZE 512
 #define MAX_OBJECT_SIZE 102400
+#define REQ_IOV_MAX 32 // request line, kept header runs and our headers
 
 // You won't lose style points for including this long line in your code
 static const char *user_agent_hdr =
     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
+static const char *close_hdrs = "Connection: close\r\nProxy-Connection: close\r\n\r\n";
 
 void command(void);
 
 FILE *logfile;
 int efd;
+
+volatile sig_atomic_t shutdown_requested = 0; // SIGTERM/SIGINT: drain and exit
+volatile sig_atomic_t reload_requested = 0;   // SIGHUP/SIGUSR2: hand off listenfd
 enum states
 {
     READ_CLIENT,
@@ -35,12 +44,16 @@ typedef struct
     int server_fd;                          // the socket corresponding to the Web server
     enum states state;                      // the current state of the request (enum)
     char original_req_buf[MAX_OBJECT_SIZE]; // the buffer to store the original client request
-    char modified_req_buf[MAX_OBJECT_SIZE]; // the buffer to store the modified client request
+    struct iovec req_iov[REQ_IOV_MAX];      // the request to send, as slices of original_req_buf and static headers
+    int req_iovcnt;                         // the number of entries in req_iov
+    int req_iov_next;                       // the first entry of req_iov not yet fully written
     char response_buf[MAX_OBJECT_SIZE];     // the buffer to store the server request
     int client_bytes_read;                  // the total number of bytes read from the client
     int server_bytes_written;               // the number of bytes written to the server
     int server_bytes_read;                  // the total number of bytes read from the server
     int client_bytes_written;               // the total number of bytes written to the client
+    uint64_t start_usec;                    // when the client connection was accepted
+    uint64_t upstream_usec;                 // when we started connecting to the server
 } req_info_t;
 
 req_info_t req_info_array[REQ_ARRAY_SIZE];
@@ -52,12 +65,68 @@ void req_info_constructor(req_info_t *req)
     req->server_fd = -1;
     req->state = READ_CLIENT;
     memset(req->original_req_buf, 0, MAX_OBJECT_SIZE);
-    memset(req->modified_req_buf, 0, MAX_OBJECT_SIZE);
+    req->req_iovcnt = 0;
+    req->req_iov_next = 0;
     memset(req->response_buf, 0, MAX_OBJECT_SIZE);
     req->client_bytes_read = 0;
     req->server_bytes_written = 0;
     req->server_bytes_read = 0;
     req->client_bytes_written = 0;
+    req->start_usec = metrics_now_usec();
+    req->upstream_usec = 0;
+}
+
+// find an unused slot, reusing ones whose request has finished
+req_info_t *req_info_alloc(void)
+{
+    for (int i = 0; i < req_info_array_size; i++)
+    {
+        req_info_t *req_info = &req_info_array[i];
+        if (req_info->client_fd == -1 && req_info->server_fd == -1)
+        {
+            return req_info;
+        }
+    }
+    if (req_info_array_size == REQ_ARRAY_SIZE)
+    {
+        return NULL;
+    }
+    return &req_info_array[req_info_array_size++];
+}
+
+// number of requests that still have a client or server connection open
+int req_info_active(void)
+{
+    int active = 0;
+    for (int i = 0; i < req_info_array_size; i++)
+    {
+        if (req_info_array[i].client_fd != -1 || req_info_array[i].server_fd != -1)
+        {
+            active++;
+        }
+    }
+    return active;
+}
+
+// abandon a request, closing whichever connections it still has open
+void req_info_close(req_info_t *req_info)
+{
+    if (req_info->state >= READ_CLIENT && req_info->state <= WRITE_CLIENT)
+    {
+        metrics_transition(req_info->state, -1);
+        metrics_inc(M_ERRORS, 1);
+    }
+    if (req_info->client_fd != -1)
+    {
+        close(req_info->client_fd);
+        req_info->client_fd = -1;
+    }
+    if (req_info->server_fd != -1)
+    {
+        close(req_info->server_fd);
+        req_info->server_fd = -1;
+    }
+    req_info->state = -1;
 }
 
 req_info_t *find_fd(int fd)
@@ -84,164 +153,145 @@ void logging(char *buf)
     fflush(logfile);
 }
 
-// parse req_info->original_req_buf
-// create req_info->modified_req_buf
-// store host/port to be used later
-void parse(req_info_t *req_info, char *host_url, char *host_port)
+// append len bytes at base to the request sent to the server
+static int add_iov(req_info_t *req_info, const char *base, size_t len)
 {
-    char buf[MAX_OBJECT_SIZE];
-    strcpy(buf, req_info->original_req_buf);
+    if (len == 0)
+    {
+        return 0;
+    }
+    if (req_info->req_iovcnt == REQ_IOV_MAX)
+    {
+        return -1;
+    }
+    req_info->req_iov[req_info->req_iovcnt].iov_base = (void *)base;
+    req_info->req_iov[req_info->req_iovcnt].iov_len = len;
+    req_info->req_iovcnt++;
+    return 0;
+}
+
+// does the header line start with the given field name?
+static int header_is(const char *line, const char *name)
+{
+    size_t len = strlen(name);
+    return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+// parse req_info->original_req_buf without copying it
+// build req_info->req_iov from the request line, the header lines we keep
+// and the headers required by the lab
+// store host/port to be used later, returns -1 for a bad request
+int parse(req_info_t *req_info, char *host_url, char *host_port)
+{
+    char *buf = req_info->original_req_buf;
+    char *end = strstr(buf, "\r\n\r\n"); // read_client waits for this
+    char *line_end = strstr(buf, "\r\n");
+    int hasHostHeader = 0;
+    int err = 0;
 
     //Begin parsing
-    char *req_type = strtok(buf, " ");
-    if (strcmp(req_type, "GET") != 0)
+    char *uri = memchr(buf, ' ', line_end - buf);
+    if (uri == NULL || uri - buf != 3 || strncmp(buf, "GET", 3) != 0)
+    {
+        LOG_WARN("Bad req_type: %.*s", (int)(line_end - buf), buf);
+        return -1;
+    }
+    uri++;
+    if (strncmp(uri, "http://", 7) != 0)
     {
-        fprintf(stderr, "Bad req_type: %s\n", req_type);
-        // TODO: discard request
+        LOG_WARN("bad http: %.*s", (int)(line_end - uri), uri);
+        return -1;
     }
-    char *http = strtok(NULL, "//");
-    if (strcmp(http, "http:") != 0)
+    char *host = uri + 7;
+    char *uri_end = memchr(host, ' ', line_end - host);
+    if (uri_end == NULL)
     {
-        fprintf(stderr, "bad http: %s\n", http);
-        // TODO: discard request
+        LOG_WARN("bad request, not HTTP/1.1");
+        return -1;
     }
-    char *host = strtok(NULL, "/");
-    // printf("host: %s\n", host);
-    if (strlen(host) == 0)
+    char *path = memchr(host, '/', uri_end - host); // NULL for "http://host"
+    char *host_end = path ? path : uri_end;
+    if (host_end == host)
     {
-        fprintf(stderr, "bad host: %s\n", host);
-        // TODO: discard request
+        LOG_WARN("bad host: %.*s", (int)(line_end - buf), buf);
+        return -1;
     }
     // find if contains port
-    char *port = NULL; //default
-    char *colonPos = strchr(host, ':');
+    char *colonPos = memchr(host, ':', host_end - host);
+    char *name_end = colonPos ? colonPos : host_end;
+    memcpy(host_url, host, name_end - host);
+    host_url[name_end - host] = '\0';
     if (colonPos)
     {
-        port = colonPos + 1; //set port to point to one char after colon
-        colonPos[0] = '\0';  //change colon to null char
+        memcpy(host_port, colonPos + 1, host_end - colonPos - 1);
+        host_port[host_end - colonPos - 1] = '\0';
     }
-    // printf("host: %s, port: %s\n", host, port);
-    char *path = strtok(NULL, "\r\n"); //path contains the rest of the first line, including HTTP/1.1
-    char *pathEnd = strchr(path, ' '); //find the first space, which is the real end of the path.
-    pathEnd[0] = '\0';
-    if (path == NULL)
+
+    /* the request line: "GET " /path " HTTP/1.0" */
+    err |= add_iov(req_info, buf, uri - buf);
+    if (path)
     {
-        fprintf(stderr, "bad request, not HTTP/1.1");
-        // TODO discard request;
+        err |= add_iov(req_info, path, uri_end - path);
     }
-    // printf("path: %s\n\n", path);
-    // TODO: verify that HTTP/1.1 was sent, else invalid request
-
-    /* begin putting together my request*/
-    char myRequest[MAX_OBJECT_SIZE] = "";
-    strcat(myRequest, req_type);
-    strcat(myRequest, " /"); //path is missing the beggining slash, so adding it here.
-    strcat(myRequest, path);
-    strcat(myRequest, " ");
-    strcat(myRequest, "HTTP/1.0\r\n");
-
-    int hasHostHeader = 0;
-    char *header;
-    while ((header = strtok(NULL, "\r\n")) != NULL)
+    else
     {
-        char *colon = strchr(header, ':');
-        colon[0] = '\0'; // temporary
+        err |= add_iov(req_info, "/", 1);
+    }
+    err |= add_iov(req_info, " HTTP/1.0\r\n", 11);
 
-        if (strcmp(header, "Connection") == 0)
-        {
-            //throw away, I'll add my own later
-            continue;
-        }
-        if (strcmp(header, "Proxy-Connection") == 0)
-        {
-            //throw away, I'll add my own later
-            continue;
-        }
-        if (strcmp(header, "User-Agent") == 0)
+    // pass through runs of header lines, skipping the ones we replace
+    char *line = line_end + 2;
+    char *run = line;
+    while (line < end + 2)
+    {
+        char *next = strstr(line, "\r\n") + 2;
+        if (header_is(line, "Connection") || header_is(line, "Proxy-Connection") ||
+            header_is(line, "User-Agent"))
         {
-            //throw away, I'll add my own later
-            continue;
+            err |= add_iov(req_info, run, line - run);
+            run = next;
         }
-        if (strcmp(header, "Host") == 0)
+        else if (header_is(line, "Host"))
         {
             hasHostHeader = 1;
         }
-
-        colon[0] = ':';
-        strcat(myRequest, header);
-        strcat(myRequest, "\r\n");
+        line = next;
     }
+    err |= add_iov(req_info, run, line - run);
     if (!hasHostHeader)
     {
-        strcat(myRequest, host);
-        strcat(myRequest, "\r\n");
+        err |= add_iov(req_info, "Host: ", 6);
+        err |= add_iov(req_info, host, host_end - host);
+        err |= add_iov(req_info, "\r\n", 2);
     }
     // headers required by the lab
-    strcat(myRequest, user_agent_hdr);
-    strcat(myRequest, "Connection: close");
-    strcat(myRequest, "\r\n");
-    strcat(myRequest, "Proxy-Connection: close");
-    strcat(myRequest, "\r\n");
-    strcat(myRequest, "\r\n");
+    err |= add_iov(req_info, user_agent_hdr, strlen(user_agent_hdr));
+    err |= add_iov(req_info, close_hdrs, strlen(close_hdrs));
     // End parsing
 
-    strcpy(host_url, host);
-    if (port == NULL)
+    if (err)
     {
-        host_port = NULL;
+        LOG_WARN("bad request, too many headers to rewrite");
+        return -1;
     }
-    else
-    {
-        strcpy(host_port, port);
-    }
-    strcpy(req_info->modified_req_buf, myRequest);
-    return;
+    return 0;
 }
 
 int connect_to_server(char *host, char *port)
 {
-    // Provided client code
-    struct addrinfo hints;
-    struct addrinfo *result;
-    struct addrinfo *rp;
-    int hostfd;
-    /* Obtain address(es) matching host/port */
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;     /* Allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_STREAM; /* TCP socket */
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0; /* Any protocol */
-    //host and port come from the original http GET request
-    int s = getaddrinfo(host, port ? port : "80", &hints, &result);
-    if (s != 0)
-    {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
-        exit(EXIT_FAILURE);
-    }
-    /* getaddrinfo() returns a list of address structures.
-    Try each address until we successfully connect(2).
-    If socket(2) (or connect(2)) fails, we (close the socket
-    and) try the next address. */
-    // TODO: the spec says I don't need to loop.  My program halts here.
-    for (rp = result; rp != NULL; rp = rp->ai_next)
-    {
-        hostfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (hostfd == -1)
-            continue;
-        if (connect(hostfd, rp->ai_addr, rp->ai_addrlen) != -1)
-            break; /* Success */
-        close(hostfd);
-    }
-    if (rp == NULL)
-    { /* No address succeeded */
-        fprintf(stderr, "Could not connect\n");
-    }
-    freeaddrinfo(result); /* No longer needed */
+    // open_clientfd races the host's addresses (happy eyeballs), so one
+    // dead address costs CONNECT_DELAY ms rather than a full TCP timeout
+    int hostfd = open_clientfd(host, port ? port : "80");
+    if (hostfd < 0)
+    {
+        LOG_WARN("Could not connect to %s:%s", host, port ? port : "80");
+        return -1;
+    }
 
     // set fd to non-blocking (set flags while keeping existing flags)
     if (fcntl(hostfd, F_SETFL, fcntl(hostfd, F_GETFL, 0) | O_NONBLOCK) < 0)
     {
-        fprintf(stderr, "error setting socket option\n");
+        LOG_ERROR("error setting socket option");
         exit(1);
     }
 
@@ -250,7 +300,7 @@ int connect_to_server(char *host, char *port)
 
 void read_client(req_info_t *req_info)
 {
-    printf("read_client\n");
+    LOG_DEBUG("read_client: fd %d", req_info->client_fd);
     // char buf[MAX_OBJECT_SIZE];
     // ssize_t nread = 0;
     while (!strstr(req_info->original_req_buf, "\r\n\r\n"))
@@ -265,7 +315,7 @@ void read_client(req_info_t *req_info)
             }
             else
             {
-                perror("error reading");
+                LOG_ERROR("error reading: %s", strerror(errno));
                 exit(errno);
             }
         }
@@ -276,6 +326,7 @@ void read_client(req_info_t *req_info)
         else
         {
             req_info->client_bytes_read += bytes_read;
+            metrics_inc(M_BYTES_FROM_CLIENT, bytes_read);
         }
     }
 
@@ -284,20 +335,30 @@ void read_client(req_info_t *req_info)
     memset(host_url, 0, MAX_OBJECT_SIZE);
     memset(host_port, 0, MAX_OBJECT_SIZE);
 
-    parse(req_info, host_url, host_port);
+    if (parse(req_info, host_url, host_port) < 0)
+    {
+        req_info_close(req_info);
+        return;
+    }
     logging(req_info->original_req_buf);
-    printf("after logging\n");
-    req_info->server_fd = connect_to_server(host_url, host_port);
-    printf("fd: %d\n", req_info->server_fd);
+    req_info->upstream_usec = metrics_now_usec();
+    req_info->server_fd = connect_to_server(host_url, host_port[0] ? host_port : NULL);
+    if (req_info->server_fd < 0)
+    {
+        req_info_close(req_info);
+        return;
+    }
+    LOG_DEBUG("connected to %s, fd %d", host_url, req_info->server_fd);
 
     struct epoll_event event;
     event.data.fd = req_info->server_fd;
     event.events = EPOLLOUT | EPOLLET; // use edge-triggered monitoring
     if (epoll_ctl(efd, EPOLL_CTL_ADD, req_info->server_fd, &event) < 0)
     {
-        fprintf(stderr, "error adding event\n");
+        LOG_ERROR("error adding event");
         exit(1);
     }
+    metrics_transition(READ_CLIENT, WRITE_SERVER);
     req_info->state = WRITE_SERVER;
 
     return;
@@ -305,11 +366,11 @@ void read_client(req_info_t *req_info)
 
 void write_server(req_info_t *req_info)
 {
-    //write request
-    int modified_req_len = strlen(req_info->modified_req_buf);
-    while (req_info->server_bytes_written != modified_req_len)
+    //write request, picking up where a short writev() left off
+    while (req_info->req_iov_next != req_info->req_iovcnt)
     {
-        int bytes_written = write(req_info->server_fd, req_info->modified_req_buf + req_info->server_bytes_written, modified_req_len - req_info->server_bytes_written);
+        struct iovec *iov = &req_info->req_iov[req_info->req_iov_next];
+        ssize_t bytes_written = writev(req_info->server_fd, iov, req_info->req_iovcnt - req_info->req_iov_next);
         if (bytes_written == -1)
         {
             if (errno == EWOULDBLOCK || errno == EAGAIN)
@@ -319,7 +380,7 @@ void write_server(req_info_t *req_info)
             }
             else
             {
-                perror("error writting");
+                LOG_ERROR("error writing: %s", strerror(errno));
                 exit(errno);
             }
         }
@@ -330,6 +391,23 @@ void write_server(req_info_t *req_info)
         else
         {
             req_info->server_bytes_written += bytes_written;
+            metrics_inc(M_BYTES_TO_SERVER, bytes_written);
+            // skip the slices that went out whole, trim a partial one
+            while (bytes_written > 0)
+            {
+                if ((size_t)bytes_written >= iov->iov_len)
+                {
+                    bytes_written -= iov->iov_len;
+                    req_info->req_iov_next++;
+                    iov++;
+                }
+                else
+                {
+                    iov->iov_base = (char *)iov->iov_base + bytes_written;
+                    iov->iov_len -= bytes_written;
+                    bytes_written = 0;
+                }
+            }
         }
     }
     // while loop ends naturally
@@ -339,9 +417,10 @@ void write_server(req_info_t *req_info)
     event.events = EPOLLIN | EPOLLET; // use edge-triggered monitoring
     if (epoll_ctl(efd, EPOLL_CTL_MOD, req_info->server_fd, &event) < 0)
     {
-        fprintf(stderr, "error adding event\n");
+        LOG_ERROR("error adding event");
         exit(1);
     }
+    metrics_transition(WRITE_SERVER, READ_SERVER);
     req_info->state = READ_SERVER;
     return;
 }
@@ -362,13 +441,14 @@ void read_server(req_info_t *req_info)
             }
             else
             {
-                perror("error reading");
+                LOG_ERROR("error reading: %s", strerror(errno));
                 exit(errno);
             }
         }
         else
         {
             req_info->server_bytes_read += bytes_read;
+            metrics_inc(M_BYTES_FROM_SERVER, bytes_read);
         }
     } while (bytes_read != 0);
     //loop ends naturally
@@ -378,9 +458,11 @@ void read_server(req_info_t *req_info)
     event.events = EPOLLOUT | EPOLLET; // use edge-triggered monitoring
     if (epoll_ctl(efd, EPOLL_CTL_MOD, req_info->client_fd, &event) < 0)
     {
-        fprintf(stderr, "error adding event\n");
+        LOG_ERROR("error adding event");
         exit(1);
     }
+    metrics_transition(READ_SERVER, WRITE_CLIENT);
+    metrics_observe(H_UPSTREAM_USEC, metrics_now_usec() - req_info->upstream_usec);
     req_info->state = WRITE_CLIENT;
     close(req_info->server_fd); // close file descriptor
     req_info->server_fd = -1;   // set fd to -1 so it won't be found in search
@@ -404,7 +486,7 @@ void write_client(req_info_t *req_info)
             }
             else
             {
-                perror("error writting");
+                LOG_ERROR("error writing: %s", strerror(errno));
                 exit(errno);
             }
         }
@@ -415,10 +497,14 @@ void write_client(req_info_t *req_info)
         else
         {
             req_info->client_bytes_written += bytesWritten;
+            metrics_inc(M_BYTES_TO_CLIENT, bytesWritten);
         }
     }
     //loop ends naturally
 
+    metrics_transition(WRITE_CLIENT, -1);
+    metrics_inc(M_REQUESTS, 1);
+    metrics_observe(H_REQUEST_USEC, metrics_now_usec() - req_info->start_usec);
     req_info->state = -1;       //done
     close(req_info->client_fd); // close file descriptor
     req_info->client_fd = -1;   // set fd to -1 so it won't be found in search
@@ -426,9 +512,82 @@ void write_client(req_info_t *req_info)
     return;
 }
 
+void shutdown_handler(int sig)
+{
+    shutdown_requested = 1;
+}
+
+void reload_handler(int sig)
+{
+    reload_requested = 1;
+}
+
+// install handler without SA_RESTART so epoll_wait() returns EINTR promptly
+void install_handler(int signum, handler_t *handler)
+{
+    struct sigaction action;
+
+    action.sa_handler = handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    if (sigaction(signum, &action, NULL) < 0)
+    {
+        unix_error("sigaction error");
+    }
+}
+
+// serve metrics on the optional admin port, argv[2]
+void start_admin(char **argv)
+{
+    if (argv[2] != NULL && metrics_admin_start(argv[2], NULL) < 0)
+    {
+        LOG_ERROR("error opening admin port %s", argv[2]);
+    }
+}
+
+// start a fresh proxy and pass it our listening socket.  Returns 0 once the
+// new process has acknowledged that it is accepting, -1 if we should keep
+// listening ourselves.
+int reload(int listenfd, char **argv)
+{
+    int sock;
+    pid_t pid;
+
+    metrics_admin_stop(); // the new process binds the admin port itself
+    if ((pid = handoff_spawn(argv, &sock)) < 0)
+    {
+        LOG_ERROR("reload: spawn: %s", strerror(errno));
+        start_admin(argv);
+        return -1;
+    }
+    if (handoff_send_fd(sock, listenfd) < 0 || handoff_wait_ack(sock) < 0)
+    {
+        LOG_WARN("reload: process %d did not take over, still listening", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        close(sock);
+        start_admin(argv);
+        return -1;
+    }
+    close(sock);
+    LOG_INFO("reload: process %d is accepting, draining", pid);
+    return 0;
+}
+
+// stop accepting new connections; in-flight requests keep running
+void stop_listening(int listenfd)
+{
+    if (epoll_ctl(efd, EPOLL_CTL_DEL, listenfd, NULL) < 0)
+    {
+        LOG_ERROR("error removing event");
+    }
+    close(listenfd);
+}
+
 int main(int argc, char **argv)
 {
     logfile = fopen("log.txt", "a");
+    log_init();
 
     int listenfd, connfd;
     socklen_t clientlen;
@@ -436,27 +595,53 @@ int main(int argc, char **argv)
     struct epoll_event event;
     struct epoll_event *events;
     int i;
+    int handoff_sock;
+    int listening = 1;
 
-    size_t n;
+    int n;
 
-    if (argc != 2)
+    if (argc != 2 && argc != 3)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        LOG_ERROR("usage: %s <port> [admin port]", argv[0]);
         exit(0);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    // a reloading parent hands us its listening socket instead of us binding
+    if ((handoff_sock = handoff_inherited_sock()) >= 0)
+    {
+        if ((listenfd = handoff_recv_fd(handoff_sock)) < 0)
+        {
+            LOG_ERROR("error receiving listening socket");
+            exit(1);
+        }
+    }
+    else
+    {
+        // dual-stack, and clients only reach accept once their request is in
+        listenopts_t opts;
+        listenopts_init(&opts);
+        opts.dualstack = 1;
+        opts.defer_accept = 1;
+        listenfd = Open_listenfd_opts(argv[1], &opts);
+    }
+
+    install_handler(SIGTERM, shutdown_handler);
+    install_handler(SIGINT, shutdown_handler);
+    install_handler(SIGHUP, reload_handler);
+    install_handler(SIGUSR2, reload_handler);
+    Signal(SIGPIPE, SIG_IGN);
+    start_admin(argv);
 
     // set fd to non-blocking (set flags while keeping existing flags)
     if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK) < 0)
     {
-        fprintf(stderr, "error setting socket option\n");
+        LOG_ERROR("error setting socket option");
         exit(1);
     }
 
     if ((efd = epoll_create1(0)) < 0)
     {
-        fprintf(stderr, "error creating epoll fd\n");
+        LOG_ERROR("error creating epoll fd: %s", strerror(errno));
         exit(1);
     }
 
@@ -464,28 +649,51 @@ int main(int argc, char **argv)
     event.events = EPOLLIN | EPOLLET; // use edge-triggered monitoring
     if (epoll_ctl(efd, EPOLL_CTL_ADD, listenfd, &event) < 0)
     {
-        fprintf(stderr, "error adding event\n");
+        LOG_ERROR("error adding event");
         exit(1);
     }
 
     /* Buffer where events are returned */
     events = calloc(MAXEVENTS, sizeof(event));
 
-    while (1)
+    if (handoff_sock >= 0)
     {
-        // wait for event to happen (no timeout)
-        n = epoll_wait(efd, events, MAXEVENTS, 1000); // The spec said 1 second tieout
-        // TODO:
-        /*
-			1. If the result was a timeout (i.e., return value from epoll_wait() is 0),
-			check if a global flag has been set by a handler and, if so, break out of the loop;
-			otherwise, continue.
+        // we are ready to accept; the old process can stop listening
+        handoff_ack(handoff_sock);
+        close(handoff_sock);
+    }
 
-			2. If the result was an error (i.e., return value from epoll_wait() is less than 0),
-			handle the error appropriately (see the man page for epoll_wait for more).
+    while (1)
+    {
+        // wait for event to happen (1 second timeout so flags get checked)
+        n = epoll_wait(efd, events, MAXEVENTS, 1000);
+        if (n < 0)
+        {
+            if (errno != EINTR)
+            {
+                LOG_ERROR("epoll_wait: %s", strerror(errno));
+                exit(1);
+            }
+            n = 0; // interrupted by a signal, check the flags below
+        }
 
-			3. 
-		*/
+        if (listening && reload_requested)
+        {
+            reload_requested = 0;
+            if (reload(listenfd, argv) == 0)
+            {
+                shutdown_requested = 1;
+            }
+        }
+        if (listening && shutdown_requested)
+        {
+            stop_listening(listenfd);
+            listening = 0;
+        }
+        if (!listening && req_info_active() == 0)
+        {
+            break; // drained
+        }
 
         for (i = 0; i < n; i++)
         {
@@ -494,12 +702,20 @@ int main(int argc, char **argv)
                 (events[i].events & EPOLLRDHUP))
             {
                 /* An error has occured on this fd */
-                fprintf(stderr, "epoll error on fd %d\n", events[i].data.fd);
-                close(events[i].data.fd);
+                LOG_WARN("epoll error on fd %d", events[i].data.fd);
+                req_info_t *req_info = find_fd(events[i].data.fd);
+                if (req_info != NULL)
+                {
+                    req_info_close(req_info); // so draining doesn't wait on it
+                }
+                else
+                {
+                    close(events[i].data.fd);
+                }
                 continue;
             }
 
-            if (events[i].data.fd == listenfd)
+            if (listening && events[i].data.fd == listenfd)
             { //line:conc:select:listenfdready
                 clientlen = sizeof(struct sockaddr_storage);
 
@@ -510,7 +726,7 @@ int main(int argc, char **argv)
                     // set fd to non-blocking (set flags while keeping existing flags)
                     if (fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL, 0) | O_NONBLOCK) < 0)
                     {
-                        fprintf(stderr, "error setting socket option\n");
+                        LOG_ERROR("error setting socket option");
                         exit(1);
                     }
 
@@ -519,15 +735,20 @@ int main(int argc, char **argv)
                     event.events = EPOLLIN | EPOLLET; // use edge-triggered monitoring
                     if (epoll_ctl(efd, EPOLL_CTL_ADD, connfd, &event) < 0)
                     {
-                        fprintf(stderr, "error adding event\n");
+                        LOG_ERROR("error adding event");
                         exit(1);
                     }
-                    // TODO: do I make a req_info object here?
-                    req_info_t req_info;
-                    req_info_constructor(&req_info);
-                    req_info.client_fd = connfd;
-                    req_info_array[req_info_array_size] = req_info;
-                    req_info_array_size++;
+                    req_info_t *req_info = req_info_alloc();
+                    if (req_info == NULL)
+                    {
+                        LOG_WARN("too many requests, dropping fd %d", connfd);
+                        close(connfd);
+                        continue;
+                    }
+                    req_info_constructor(req_info);
+                    req_info->client_fd = connfd;
+                    metrics_inc(M_CONNECTIONS, 1);
+                    metrics_transition(-1, READ_CLIENT);
                 }
 
                 if (errno == EWOULDBLOCK || errno == EAGAIN)
@@ -536,7 +757,7 @@ int main(int argc, char **argv)
                 }
                 else
                 {
-                    perror("error accepting");
+                    LOG_ERROR("error accepting: %s", strerror(errno));
                 }
             }
             else //line:conc:select:listenfdready
@@ -546,7 +767,7 @@ int main(int argc, char **argv)
                 req_info_t *req_info = find_fd(events[i].data.fd);
                 if (req_info == NULL)
                 {
-                    fprintf(stderr, "NULL pointer exception!\n");
+                    LOG_ERROR("no request for fd %d", events[i].data.fd);
                     exit(1);
                 }
                 // check its state with a switch statement
@@ -565,7 +786,7 @@ int main(int argc, char **argv)
                     write_client(req_info);
                     break;
                 default:
-                    fprintf(stderr, "The state doesn't match! state: %d\n", req_info->state);
+                    LOG_WARN("The state doesn't match! state: %d", req_info->state);
                 }
 
                 // while ((len = recv(events[i].data.fd, buf, MAXLINE, 0)) > 0)
@@ -592,6 +813,8 @@ int main(int argc, char **argv)
         }
     }
     free(events);
+    fclose(logfile);
+    return 0;
 }
 
 /* $end select */
@@ -0,0 +1,163 @@
+#!/bin/bash
+#
+# bench.sh - Load-tests tiny on its own: for each combination of
+#     accept model and tiny options asked for, starts tiny on a free
+#     port and drives each workload (static files of several sizes,
+#     cgi-bin/adder and a 404) closed-loop with ../loadgen, printing
+#     one line of requests/sec and latency percentiles per run.
+#
+#     usage: ./bench.sh [seconds] [concurrency] [keepalive] [models] [options]
+#     e.g.   ./bench.sh 5 16 1 "fork thread" "-c none|-c fd|-c mem"
+#
+#     With keep-alive, a concurrency above tiny's thread count (-t,
+#     16 by default) leaves the extra connections queued in the sbuf
+#     until a worker's connection closes, which shows up as latency
+#     outliers and unfinished requests rather than throughput.
+#
+#     models is a space-separated list of -m values; options is a
+#     |-separated list of extra tiny flags to try with each of them
+#     ("" runs tiny with none).  Set WORKLOADS to run only some of
+#     small, medium, large, adder and 404.
+#
+
+DURATION=${1:-5}
+CONNS=${2:-16}
+KEEPALIVE=${3:-1}
+MODELS=${4:-"fork thread"}
+OPTIONS=${5:-""}
+WORKLOADS=${WORKLOADS:-"small medium large adder 404"}
+
+HOME_DIR=`pwd`
+FILES_DIR=bench-files
+PORT_START=1024
+PORT_MAX=65000
+MAX_RAND=63000
+MAX_PORT_TRIES=10
+
+#
+# free_port - returns an available unused TCP port
+#
+function free_port {
+    port=$((( RANDOM % ${MAX_RAND}) + ${PORT_START}))
+
+    while [ TRUE ]
+    do
+        portsinuse=`netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+            | grep tcp | awk '{print $4}' | sed 's/.*://' \
+            | grep -E "[0-9]+" | uniq | tr "\n" " "`
+
+        echo "${portsinuse}" | grep -wq "${port}"
+        if [ "$?" == "0" ]; then
+            if [ $port -eq ${PORT_MAX} ]
+            then
+                echo "-1"
+                return
+            fi
+            port=`expr ${port} + 1`
+        else
+            echo "${port}"
+            return
+        fi
+    done
+}
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Gives up after MAX_PORT_TRIES.
+#
+function wait_for_port_use() {
+    tries="0"
+    until netstat --numeric-ports --numeric-hosts -a --protocol=inet,inet6 \
+        | grep tcp | awk '{print $4}' | sed 's/.*://' \
+        | grep -wq "${1}"
+    do
+        tries=`expr ${tries} + 1`
+        if [ "${tries}" == "${MAX_PORT_TRIES}" ]; then
+            echo "Error: nothing listening on port ${1}"
+            cleanup
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+function stop_tiny {
+    kill $tiny_pid 2> /dev/null
+    wait $tiny_pid 2> /dev/null
+}
+
+function cleanup {
+    stop_tiny
+    rm -rf "${HOME_DIR}/${FILES_DIR}"
+}
+
+#
+# workload_url - the URL a workload fetches from tiny on port $2
+#
+function workload_url() {
+    case $1 in
+        small)  echo "http://localhost:$2/${FILES_DIR}/1k.html" ;;
+        medium) echo "http://localhost:$2/${FILES_DIR}/64k.gif" ;;
+        large)  echo "http://localhost:$2/${FILES_DIR}/1m.gif" ;;
+        adder)  echo "http://localhost:$2/cgi-bin/adder?15213&18213" ;;
+        404)    echo "http://localhost:$2/${FILES_DIR}/missing.html" ;;
+    esac
+}
+
+if [ ! -x ../loadgen -o ! -x ./tiny -o ! -x ./cgi-bin/adder ]; then
+    echo "Error: build tiny, cgi-bin and ../loadgen first (make bench does this)"
+    exit 1
+fi
+
+# Files of several sizes: one well inside the memory cache, one near
+# its 128KB limit and one that always goes out with sendfile
+trap "cleanup; exit 1" INT TERM
+mkdir -p ${FILES_DIR}
+head -c 1024 /dev/urandom | base64 -w 64 | head -c 1024 > ${FILES_DIR}/1k.html
+head -c 65536 /dev/urandom > ${FILES_DIR}/64k.gif
+head -c 1048576 /dev/urandom > ${FILES_DIR}/1m.gif
+
+flags=""
+[ "${KEEPALIVE}" != "0" ] && flags="-k"
+echo "*** Benchmark: tiny, ${CONNS} in flight for ${DURATION}s per run, keep-alive ${KEEPALIVE}"
+printf "%-28s %-7s %10s %9s %9s %9s %9s %7s\n" \
+    "tiny flags" "load" "req/s" "MB/s" "p50 ms" "p99 ms" "p99.9 ms" "errors"
+status=0
+IFS='|' read -ra option_list <<< "${OPTIONS}"
+[ ${#option_list[@]} -eq 0 ] && option_list=("")
+for model in ${MODELS}
+do
+    for options in "${option_list[@]}"
+    do
+        tiny_port=$(free_port)
+        ./tiny -m ${model} ${options} ${tiny_port} &> /dev/null &
+        tiny_pid=$!
+        wait_for_port_use "${tiny_port}"
+
+        for load in ${WORKLOADS}
+        do
+            url=$(workload_url ${load} ${tiny_port})
+            if [ -z "${url}" ]; then
+                echo "Error: unknown workload ${load}"
+                cleanup
+                exit 1
+            fi
+            ../loadgen -r 0 -d ${DURATION} -c ${CONNS} ${flags} "${url}" > bench.out
+            [ $? -ne 0 ] && status=2
+            # completed:  N (M non-2xx), E errors, U unfinished
+            # throughput: R req/s, B MB/s
+            # latency ms: p50 A  p90 B  p99 C  p99.9 D  max E
+            awk -v cfg="-m ${model} ${options}" -v load="${load}" '
+                /^completed:/  { errors = $5 + $7 }
+                /^throughput:/ { rps = $2; mbs = $4 }
+                /^latency ms:/ { p50 = $4; p99 = $8; p999 = $10 }
+                END { printf "%-28s %-7s %10s %9s %9s %9s %9s %7s\n",
+                             cfg, load, rps, mbs, p50, p99, p999, errors }' bench.out
+        done
+        rm -f bench.out
+        stop_tiny
+    done
+done
+
+cleanup
+exit ${status}
@@ -0,0 +1,92 @@
+/*
+ * cgiworker.c - adapter that lets an unmodified csapp-style CGI
+ *     program run as one of tiny's persistent workers (see cgipool.h).
+ *     Compile the program with -Dmain=cgi_main -Dexit=cgi_exit and
+ *     link it with this file.  Started by tiny, it then serves one
+ *     request after another: QUERY_STRING is set, stdout is the client
+ *     socket, and cgi_main's exit() returns here instead of ending the
+ *     process.  Started any other way it is the ordinary CGI program.
+ *     The CGI_WORKER_MAGIC string below is how tiny knows to pool it.
+ */
+/* $begin cgiworker */
+#include <setjmp.h>
+#include "csapp.h"
+#include "cgipool.h"
+
+int cgi_main(void);
+void cgi_exit(int status) __attribute__((noreturn));
+
+static const char magic[] __attribute__((used)) = CGI_WORKER_MAGIC;
+static int in_worker;
+static jmp_buf request_done;
+
+/* The program's exit(): finish this request, not the process */
+void cgi_exit(int status)
+{
+    if (!in_worker)
+	exit(status);
+    longjmp(request_done, 1);
+}
+
+/* Read a whole record of at most size payload bytes, and any fd */
+static int read_request(int sock, char *query, size_t size, int *connfd)
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr *cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    cgi_record_t rec;
+    ssize_t n;
+
+    *connfd = -1;
+    iov.iov_base = &rec;
+    iov.iov_len = sizeof(rec);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if ((n = recvmsg(sock, &msg, MSG_WAITALL)) != sizeof(rec))
+	return -1;          /* EOF: tiny is gone or retired us */
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	    memcpy(connfd, CMSG_DATA(cmsg), sizeof(int));
+    if (rec.type != CGI_REQUEST || rec.len >= size || *connfd < 0)
+	return -1;
+    if (rec.len > 0 && recv(sock, query, rec.len, MSG_WAITALL) != rec.len)
+	return -1;
+    query[rec.len] = '\0';
+    return 0;
+}
+
+int main(void)
+{
+    cgi_record_t ready = { CGI_READY, 0 }, done = { CGI_DONE, 0 };
+    char query[MAXLINE];
+    int connfd, nullfd;
+
+    if (getenv(CGI_WORKER_ENV) == NULL)
+	return cgi_main();  /* Run as an ordinary CGI program */
+    unsetenv(CGI_WORKER_ENV);
+    in_worker = 1;
+    signal(SIGPIPE, SIG_IGN); /* A client hanging up ends only its request */
+    /* tiny pointed stdout at /dev/null; keep it for between requests */
+    if ((nullfd = dup(STDOUT_FILENO)) < 0 ||
+	write(CGI_WORKER_FD, &ready, sizeof(ready)) != sizeof(ready))
+	return 1;
+
+    while (read_request(CGI_WORKER_FD, query, sizeof(query), &connfd) == 0) {
+	setenv("QUERY_STRING", query, 1);
+	dup2(connfd, STDOUT_FILENO);  /* Redirect stdout to client */
+	close(connfd);
+	if (setjmp(request_done) == 0)
+	    cgi_main();
+	fflush(stdout);
+	clearerr(stdout);
+	dup2(nullfd, STDOUT_FILENO);  /* Let go of the client */
+	if (write(CGI_WORKER_FD, &done, sizeof(done)) != sizeof(done))
+	    break;
+    }
+    return 0;
+}
+/* $end cgiworker */
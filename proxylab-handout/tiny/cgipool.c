@@ -0,0 +1,275 @@
+/*
+ * cgipool.c - FastCGI-style persistent workers for tiny's dynamic
+ *     content.  The first request for a CGI program looks in its file
+ *     for CGI_WORKER_MAGIC, which only programs built with
+ *     cgi-bin/cgiworker.c carry; anything else is remembered as a
+ *     plain CGI program and keeps being forked per request, and is
+ *     never run just to find out.  Workers are started on demand, up
+ *     to nworkers per program, with a socket to tiny on CGI_WORKER_FD,
+ *     and answer CGI_READY before serving requests in a loop.  A
+ *     request goes to an idle worker along with the client socket, and
+ *     tiny moves on without waiting; the worker's CGI_DONE is collected
+ *     the next time a request needs a worker.
+ */
+/* $begin cgipoolc */
+#include <poll.h>
+#include "cgipool.h"
+
+#define CGI_MAXPROGS 16
+#define CGI_READY_MS 1000 /* How long a new worker gets to say hello */
+
+typedef struct {
+    pid_t pid;
+    int sock;           /* Our end of the socket, -1 if not running */
+    int busy;           /* Has a request it hasn't reported done */
+    int starting;       /* A thread is starting it without the mutex */
+} cgi_worker_t;
+
+typedef struct {
+    char *path;
+    int pooled;         /* Carries CGI_WORKER_MAGIC, until it fails to start */
+    int hello;          /* Some worker has answered CGI_READY */
+    cgi_worker_t *workers;
+} cgi_prog_t;
+
+static int nworkers;                  /* Per program, 0 disables the pool */
+static sem_t mutex;                   /* Protects everything below */
+static cgi_prog_t progs[CGI_MAXPROGS];
+static int nprogs;
+
+void cgipool_init(int n)
+{
+    nworkers = n;
+    Sem_init(&mutex, 0, 1);
+}
+
+static void worker_stop(cgi_worker_t *w)
+{
+    if (w->sock >= 0) {
+	close(w->sock);     /* The worker sees EOF and exits */
+	w->sock = -1;
+    }
+    w->busy = 0;
+}
+
+/* Return 1 if the file at path contains CGI_WORKER_MAGIC */
+static int has_magic(char *path)
+{
+    static const char magic[] = CGI_WORKER_MAGIC;
+    struct stat sbuf;
+    char *map, *p, *end;
+    int fd, found = 0;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return 0;
+    if (fstat(fd, &sbuf) < 0 || sbuf.st_size < (off_t)sizeof(magic) - 1 ||
+	(map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return 0;
+    }
+    close(fd);
+    end = map + sbuf.st_size - (sizeof(magic) - 1);
+    for (p = map; !found && (p = memchr(p, magic[0], end - p + 1)) != NULL; p++)
+	found = !memcmp(p, magic, sizeof(magic) - 1);
+    munmap(map, sbuf.st_size);
+    return found;
+}
+
+/*
+ * worker_start - run path as a worker and wait for its CGI_READY.
+ *     Called without the mutex: w is marked starting, so no other
+ *     thread touches it.  Returns -1 if it never says hello.
+ */
+static int worker_start(cgi_prog_t *prog, cgi_worker_t *w)
+{
+    static char fdenv[] = CGI_WORKER_ENV "=3";
+    char *argv[] = { prog->path, NULL }, **envp;
+    struct pollfd pfd;
+    cgi_record_t rec;
+    int sv[2], n, i, nullfd;
+
+    /* Build everything the child needs before forking, since it
+       may only make async-signal-safe calls before execve */
+    for (n = 0; environ[n]; n++)
+	;
+    envp = Malloc((n + 2) * sizeof(char *));
+    memcpy(envp, environ, n * sizeof(char *));
+    envp[n] = fdenv;
+    envp[n + 1] = NULL;
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+	Free(envp);
+	return -1;
+    }
+    if ((nullfd = open("/dev/null", O_WRONLY | O_CLOEXEC)) < 0) {
+	close(sv[0]);
+	close(sv[1]);
+	Free(envp);
+	return -1;
+    }
+
+    if ((w->pid = fork()) == 0) { /* Child */
+	struct sigaction action;
+	action.sa_handler = SIG_DFL;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = 0;
+	sigaction(SIGCHLD, &action, NULL);
+	sigaction(SIGPIPE, &action, NULL);
+	dup2(sv[1], CGI_WORKER_FD);
+	dup2(nullfd, STDOUT_FILENO); /* Output between requests goes nowhere */
+	execve(prog->path, argv, envp);
+	_exit(127);
+    }
+    Free(envp);
+    close(sv[1]);
+    close(nullfd);
+    if (w->pid < 0) {
+	close(sv[0]);
+	return -1;
+    }
+
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    i = poll(&pfd, 1, CGI_READY_MS);
+    if (i != 1 || read(sv[0], &rec, sizeof(rec)) != sizeof(rec) || rec.type != CGI_READY) {
+	kill(w->pid, SIGKILL);
+	close(sv[0]);
+	return -1;
+    }
+    w->sock = sv[0];
+    w->busy = 0;
+    return 0;
+}
+
+/* Collect a busy worker's CGI_DONE if it has sent it (mutex held) */
+static void worker_poll(cgi_worker_t *w)
+{
+    cgi_record_t rec;
+    ssize_t n;
+
+    n = recv(w->sock, &rec, sizeof(rec), MSG_DONTWAIT);
+    if (n == sizeof(rec) && rec.type == CGI_DONE)
+	w->busy = 0;
+    else if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	worker_stop(w);     /* Died (e.g. the CGI program crashed) */
+}
+
+/* Send a CGI_REQUEST with the client socket attached */
+static int worker_send(cgi_worker_t *w, char *cgiargs, int connfd)
+{
+    cgi_record_t rec = { CGI_REQUEST, strlen(cgiargs) };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = cgiargs;
+    iov[1].iov_len = rec.len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &connfd, sizeof(int));
+
+    /* The request is tiny, so a short send only happens if it's dead */
+    while ((n = sendmsg(w->sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+	;
+    return n == sizeof(rec) + rec.len ? 0 : -1;
+}
+
+/*
+ * cgipool_run - hand the request for filename to an idle worker,
+ *     which writes the response to connfd itself.  Returns -1 if the
+ *     caller should run the program the old way instead (pool off,
+ *     plain CGI program, or every worker busy).
+ */
+/* Look up filename's entry (mutex held), NULL if there is none */
+static cgi_prog_t *prog_find(char *filename)
+{
+    int i;
+
+    for (i = 0; i < nprogs; i++)
+	if (!strcmp(progs[i].path, filename))
+	    return &progs[i];
+    return NULL;
+}
+
+int cgipool_run(char *filename, char *cgiargs, int connfd)
+{
+    cgi_prog_t *prog;
+    cgi_worker_t *w = NULL;
+    int i, pooled, rc;
+
+    if (nworkers == 0)
+	return -1;
+    P(&mutex);
+    if ((prog = prog_find(filename)) == NULL) {
+	/* First sight of it: read the file with the mutex dropped */
+	V(&mutex);
+	pooled = has_magic(filename);
+	P(&mutex);
+	if ((prog = prog_find(filename)) == NULL && nprogs < CGI_MAXPROGS) {
+	    prog = &progs[nprogs++];
+	    prog->path = strdup(filename);
+	    prog->pooled = pooled;
+	    prog->hello = 0;
+	    prog->workers = Malloc(nworkers * sizeof(cgi_worker_t));
+	    for (i = 0; i < nworkers; i++) {
+		prog->workers[i].sock = -1;
+		prog->workers[i].busy = 0;
+		prog->workers[i].starting = 0;
+	    }
+	}
+    }
+    if (prog == NULL || !prog->pooled) {
+	V(&mutex);
+	return -1;
+    }
+
+    for (i = 0; i < nworkers && w == NULL; i++) {
+	cgi_worker_t *cand = &prog->workers[i];
+	if (cand->starting)
+	    continue;
+	if (cand->sock >= 0 && cand->busy)
+	    worker_poll(cand);
+	if (cand->sock < 0) {
+	    /* Don't stall every other CGI request for the fork and the
+	       wait for CGI_READY */
+	    cand->starting = 1;
+	    V(&mutex);
+	    rc = worker_start(prog, cand);
+	    P(&mutex);
+	    cand->starting = 0;
+	    if (rc < 0) {
+		if (!prog->hello)
+		    prog->pooled = 0; /* Never worked: fork it per request */
+		break;
+	    }
+	    prog->hello = 1;
+	}
+	if (!cand->busy)
+	    w = cand;
+    }
+    if (w == NULL) {
+	V(&mutex);
+	return -1;
+    }
+    w->busy = 1;
+    V(&mutex);
+
+    if (worker_send(w, cgiargs, connfd) < 0) {
+	P(&mutex);
+	worker_stop(w);
+	V(&mutex);
+	return -1;
+    }
+    return 0;
+}
+/* $end cgipoolc */
@@ -0,0 +1,41 @@
+#ifndef __CGIPOOL_H__
+#define __CGIPOOL_H__
+
+#include <stdint.h>
+#include "csapp.h"
+
+/*
+ * Tiny and a pooled CGI worker talk over a Unix stream socket that the
+ * worker finds on descriptor CGI_WORKER_FD (named in $TINY_CGI_FD).
+ * Every record starts with a cgi_record_t header and is followed by
+ * len bytes of payload:
+ *
+ *   CGI_READY    worker -> tiny  once at startup, no payload
+ *   CGI_REQUEST  tiny -> worker  payload is the QUERY_STRING; the
+ *                                client socket rides along (SCM_RIGHTS)
+ *   CGI_DONE     worker -> tiny  response written, payload-less
+ */
+#define CGI_WORKER_ENV "TINY_CGI_FD"
+#define CGI_WORKER_FD  3
+
+/* Built into every program linked with cgiworker.c, so tiny can tell a
+   pool program from a plain CGI program by its file, without running it */
+#define CGI_WORKER_MAGIC "tiny-cgi-worker/1"
+
+enum cgi_record_type {
+    CGI_READY = 1,
+    CGI_REQUEST,
+    CGI_DONE
+};
+
+/* $begin cgi_record_t */
+typedef struct {
+    uint32_t type;      /* enum cgi_record_type */
+    uint32_t len;       /* Payload bytes that follow */
+} cgi_record_t;
+/* $end cgi_record_t */
+
+void cgipool_init(int nworkers);
+int cgipool_run(char *filename, char *cgiargs, int connfd);
+
+#endif /* __CGIPOOL_H__ */
@@ -0,0 +1,325 @@
+/*
+ * fcache.c - A cache of open descriptors and fstat results for the
+ *     static files tiny serves.  An entry is dropped as soon as inotify
+ *     reports that its file was written, changed attributes, moved or
+ *     was deleted.  Each user holds a reference, so a dropped entry's
+ *     descriptor stays open until the last sendfile() on it is done.
+ */
+/* $begin fcachec */
+#include <sys/inotify.h>
+#include "fcache.h"
+
+#define FCACHE_BUCKETS 256
+#define FCACHE_MAX     512 /* Most descriptors the cache keeps open */
+#define FCACHE_MEM_MAX (32 << 20) /* Most bytes of attached responses */
+#define FCACHE_EVENTS  (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                        IN_MOVE_SELF | IN_DELETE_SELF)
+
+static int enabled;
+static int inotify_fd = -1;
+static sem_t mutex;                   /* Protects everything below */
+static fcache_entry_t *buckets[FCACHE_BUCKETS];
+static fcache_entry_t *oldest, *newest;
+static int count;
+static size_t mem_used;
+
+static unsigned hash(char *s)
+{
+    unsigned h = 2166136261u;         /* FNV-1a */
+
+    while (*s)
+	h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % FCACHE_BUCKETS;
+}
+
+/* Open path and fstat it into a new entry nobody else can see yet */
+static fcache_entry_t *entry_open(char *path)
+{
+    fcache_entry_t *e;
+    int fd, err;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	return NULL;
+    e = Malloc(sizeof(fcache_entry_t));
+    if (fstat(fd, &e->st) < 0) {
+	err = errno;
+	close(fd);
+	Free(e);
+	errno = err;
+	return NULL;
+    }
+    e->path = NULL;
+    e->fd = fd;
+    e->wd = -1;
+    e->refcnt = 1;
+    e->cached = 0;
+    e->resp = NULL;
+    e->hdrlen = e->resplen = 0;
+    e->gz_state = GZ_UNKNOWN;
+    e->gz_file = NULL;
+    e->gz = NULL;
+    e->gzlen = 0;
+    e->next = e->older = e->newer = NULL;
+    return e;
+}
+
+/* Close and free e once nobody holds it; locked says if mutex is held */
+static void entry_free(fcache_entry_t *e, int locked)
+{
+    fcache_entry_t *g = e->gz_file;
+
+    close(e->fd);
+    free(e->path);
+    free(e->resp);
+    free(e->gz);
+    Free(e);
+    if (g && !locked)
+	fcache_release(g);
+    else if (g && --g->refcnt == 0)
+	entry_free(g, 1);
+}
+
+/* Take e out of the table and drop the table's reference (mutex held) */
+static void entry_unlink(fcache_entry_t *e)
+{
+    fcache_entry_t **pp, *o;
+    int shared = 0;
+
+    for (pp = &buckets[hash(e->path)]; *pp != e; pp = &(*pp)->next)
+	;
+    *pp = e->next;
+    if (e->older)
+	e->older->newer = e->newer;
+    else
+	oldest = e->newer;
+    if (e->newer)
+	e->newer->older = e->older;
+    else
+	newest = e->older;
+    count--;
+    mem_used -= e->resplen + e->gzlen;
+    e->cached = 0;
+
+    /* Two paths to one inode share a watch; keep it for the other */
+    for (o = oldest; o; o = o->newer)
+	if (o->wd == e->wd)
+	    shared = 1;
+    if (!shared)
+	inotify_rm_watch(inotify_fd, e->wd);
+
+    /* Entries serving this one as their .gz variant go stale with it;
+       unlinking can take others with it too, so start over */
+    for (o = oldest; o; ) {
+	if (o->gz_file == e) {
+	    entry_unlink(o);
+	    o = oldest;
+	}
+	else
+	    o = o->newer;
+    }
+    if (--e->refcnt == 0)
+	entry_free(e, 1);
+}
+
+/* Drop every entry watched by wd, or all of them if wd is -1 */
+static void invalidate(int wd)
+{
+    fcache_entry_t *e;
+
+    P(&mutex);
+    /* Unlinking can take dependent entries with it, so start over */
+    for (e = oldest; e; ) {
+	if (wd == -1 || e->wd == wd) {
+	    entry_unlink(e);
+	    e = oldest;
+	}
+	else
+	    e = e->newer;
+    }
+    V(&mutex);
+}
+
+/* Background thread: turn inotify events into invalidations */
+static void *watch_thread(void *vargp)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+	if ((n = read(inotify_fd, buf, sizeof(buf))) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    break;
+	}
+	for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+	    ev = (struct inotify_event *)p;
+	    /* On overflow we no longer know what changed */
+	    invalidate(ev->mask & IN_Q_OVERFLOW ? -1 : ev->wd);
+	}
+    }
+    /* Without events the cache could go stale, so stop caching */
+    fprintf(stderr, "fcache: inotify read failed, caching disabled\n");
+    enabled = 0;
+    invalidate(-1);
+    return NULL;
+}
+
+/*
+ * fcache_init - set up the cache; with enabled == 0 (e.g. when tiny
+ *     forks per connection) fcache_open simply opens and fstats
+ */
+void fcache_init(int enable)
+{
+    pthread_t tid;
+
+    if (!enable)
+	return;
+    Sem_init(&mutex, 0, 1);
+    if ((inotify_fd = inotify_init1(IN_CLOEXEC)) < 0) {
+	fprintf(stderr, "fcache: inotify_init1: %s, caching disabled\n",
+		strerror(errno));
+	return;
+    }
+    enabled = 1;
+    Pthread_create(&tid, NULL, watch_thread, NULL);
+}
+
+/*
+ * fcache_open - return an open, fstat'ed entry for path, or NULL with
+ *     errno set.  The caller must fcache_release() it when done.
+ */
+fcache_entry_t *fcache_open(char *path)
+{
+    fcache_entry_t *e, *o;
+    unsigned h;
+    int wd, err;
+
+    if (!enabled)
+	return entry_open(path);
+
+    P(&mutex);
+    h = hash(path);
+    for (e = buckets[h]; e; e = e->next) {
+	if (!strcmp(e->path, path)) {
+	    e->refcnt++;
+	    V(&mutex);
+	    return e;
+	}
+    }
+
+    /* Miss: watch before opening, so no change can slip in between.
+       Holding the mutex keeps the watch thread from seeing an event
+       for this wd before the entry is in the table. */
+    wd = inotify_add_watch(inotify_fd, path, FCACHE_EVENTS);
+    if ((e = entry_open(path)) == NULL || wd < 0 || !S_ISREG(e->st.st_mode)) {
+	err = errno;
+	if (wd >= 0) {
+	    /* Only drop the watch if no cached path shares it */
+	    for (o = oldest; o && o->wd != wd; o = o->newer)
+		;
+	    if (!o)
+		inotify_rm_watch(inotify_fd, wd);
+	}
+	V(&mutex);
+	errno = err;
+	return e;               /* Uncached, or NULL */
+    }
+    if (count == FCACHE_MAX)
+	entry_unlink(oldest);
+    e->path = strdup(path);
+    e->wd = wd;
+    e->cached = 1;
+    e->refcnt++;                /* One for the table, one for the caller */
+    e->next = buckets[h];
+    buckets[h] = e;
+    e->older = newest;
+    if (newest)
+	newest->newer = e;
+    else
+	oldest = e;
+    newest = e;
+    count++;
+    V(&mutex);
+    return e;
+}
+
+/*
+ * fcache_release - drop a reference from fcache_open
+ */
+void fcache_release(fcache_entry_t *e)
+{
+    int last;
+
+    if (e->wd == -1) {
+	entry_free(e, 0);       /* Never in the table */
+	return;
+    }
+    P(&mutex);
+    last = (--e->refcnt == 0);
+    V(&mutex);
+    if (last)
+	entry_free(e, 0);
+}
+
+/*
+ * fcache_hold - take another reference to an entry we already hold
+ */
+void fcache_hold(fcache_entry_t *e)
+{
+    P(&mutex);
+    e->refcnt++;
+    V(&mutex);
+}
+
+/*
+ * fcache_attach - hand a ready-made response for e to the cache, so
+ *     later users can send it with one write.  Returns 1 if e now owns
+ *     resp, 0 if the caller keeps it (e is not cached, already has
+ *     one, or the memory budget is spent).
+ */
+int fcache_attach(fcache_entry_t *e, char *resp, size_t hdrlen, size_t resplen)
+{
+    int attached = 0;
+
+    if (e->wd == -1)
+	return 0;
+    P(&mutex);
+    if (e->cached && e->resp == NULL && mem_used + resplen <= FCACHE_MEM_MAX) {
+	e->hdrlen = hdrlen;
+	e->resplen = resplen;
+	__atomic_store_n(&e->resp, resp, __ATOMIC_RELEASE);
+	mem_used += resplen;
+	attached = 1;
+    }
+    V(&mutex);
+    return attached;
+}
+
+/*
+ * fcache_attach_gz - record e's gzip variant: either an open .gz
+ *     sibling (e then holds the caller's reference to it) or a body
+ *     the caller compressed (e then owns it).  Returns 0 and marks e
+ *     GZ_NONE if e is no longer cached or the budget is spent; the
+ *     caller keeps what it passed in.
+ */
+int fcache_attach_gz(fcache_entry_t *e, fcache_entry_t *gz_file, char *gz, size_t gzlen)
+{
+    int attached = 0;
+
+    P(&mutex);
+    if (e->cached && (gz_file ? gz_file->cached :
+		      gz != NULL && mem_used + gzlen <= FCACHE_MEM_MAX)) {
+	e->gz_file = gz_file;
+	e->gz = gz;
+	e->gzlen = gz ? gzlen : 0;
+	mem_used += e->gzlen;
+	attached = 1;
+    }
+    __atomic_store_n(&e->gz_state, attached ? GZ_READY : GZ_NONE, __ATOMIC_RELEASE);
+    V(&mutex);
+    return attached;
+}
+/* $end fcachec */
@@ -0,0 +1,42 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include "csapp.h"
+
+/* What we know about a gzip variant of an entry */
+enum fcache_gz_state {
+    GZ_UNKNOWN,                 /* Not looked for yet */
+    GZ_QUEUED,                  /* The gzip thread is on it */
+    GZ_READY,                   /* gz_file or gz is set */
+    GZ_NONE                     /* None, and not worth making one */
+};
+
+/* $begin fcachet */
+typedef struct fcache_entry {
+    char *path;                 /* Key: the filename tiny resolved */
+    int fd;                     /* Open, read-only, close-on-exec */
+    struct stat st;             /* fstat of fd when it was opened */
+    int wd;                     /* inotify watch, -1 if not cached */
+    int refcnt;                 /* Table's reference plus one per user */
+    int cached;                 /* Still reachable from the table */
+    char *resp;                 /* Ready-made headers (+ body), or NULL */
+    size_t hdrlen;              /* Header bytes at the start of resp */
+    size_t resplen;             /* hdrlen, or hdrlen + st.st_size */
+    int gz_state;               /* enum fcache_gz_state */
+    struct fcache_entry *gz_file; /* Open foo.gz sibling (GZ_READY) */
+    char *gz;                   /* Or a gzip body we made (GZ_READY) */
+    size_t gzlen;
+    struct fcache_entry *next;  /* Hash chain */
+    struct fcache_entry *older; /* Insertion order, for eviction */
+    struct fcache_entry *newer;
+} fcache_entry_t;
+/* $end fcachet */
+
+void fcache_init(int enabled);
+fcache_entry_t *fcache_open(char *path);
+void fcache_release(fcache_entry_t *e);
+int fcache_attach(fcache_entry_t *e, char *resp, size_t hdrlen, size_t resplen);
+void fcache_hold(fcache_entry_t *e);
+int fcache_attach_gz(fcache_entry_t *e, fcache_entry_t *gz_file, char *gz, size_t gzlen);
+
+#endif /* __FCACHE_H__ */
@@ -0,0 +1,155 @@
+/*
+ * gzcache.c - Finds or makes gzip variants of cached static files
+ *     off the request path.  The first gzip-capable request for a file
+ *     queues its fcache entry; a background thread then attaches the
+ *     file's up-to-date foo.gz sibling if there is one, or else (when
+ *     asked to) compresses the file with zlib and attaches the result.
+ *     Until then, and if neither works out, requests get the file as is.
+ */
+/* $begin gzcachec */
+#include <zlib.h>
+#include "gzcache.h"
+
+#define GZ_QUEUESIZE 64
+#define GZ_MAXFILE   (8 << 20) /* Don't compress anything bigger */
+
+typedef struct {
+    fcache_entry_t *e;  /* Held until the job is done */
+    int generate;       /* Compress it if there is no sibling */
+} gz_job_t;
+
+static gz_job_t queue[GZ_QUEUESIZE];
+static int front, rear;             /* As in sbuf_t */
+static sem_t mutex, items;
+
+/*
+ * gzcache_sibling - open filename.gz if it is a regular file at least
+ *     as new as e's file, else NULL
+ */
+fcache_entry_t *gzcache_sibling(fcache_entry_t *e, char *filename)
+{
+    char gzname[MAXLINE];
+    fcache_entry_t *g;
+
+    if (snprintf(gzname, sizeof(gzname), "%s.gz", filename) >= sizeof(gzname))
+	return NULL;
+    if ((g = fcache_open(gzname)) == NULL)
+	return NULL;
+    if (!S_ISREG(g->st.st_mode) || g->st.st_mtime < e->st.st_mtime) {
+	fcache_release(g);
+	return NULL;
+    }
+    return g;
+}
+
+/* Compress e's file into a new gzip buffer, or NULL if it doesn't pay */
+static char *compress_file(fcache_entry_t *e, size_t *gzlen)
+{
+    size_t len = e->st.st_size, nread = 0;
+    char *in, *out;
+    z_stream zs;
+    ssize_t n;
+    int rc;
+
+    in = Malloc(len ? len : 1);
+    while (nread < len) {
+	if ((n = pread(e->fd, in + nread, len - nread, nread)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    Free(in);
+	    return NULL;
+	}
+	nread += n;
+    }
+
+    memset(&zs, 0, sizeof(zs));
+    /* windowBits 15 + 16 asks zlib for a gzip header and trailer */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		     Z_DEFAULT_STRATEGY) != Z_OK) {
+	Free(in);
+	return NULL;
+    }
+    out = Malloc(deflateBound(&zs, len));
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = deflateBound(&zs, len);
+    rc = deflate(&zs, Z_FINISH);
+    *gzlen = zs.total_out;
+    deflateEnd(&zs);
+    Free(in);
+
+    /* Not worth a variant unless it saves at least a tenth */
+    if (rc != Z_STREAM_END || *gzlen > len - len / 10) {
+	Free(out);
+	return NULL;
+    }
+    return out;
+}
+
+static void *gzip_thread(void *vargp)
+{
+    fcache_entry_t *g;
+    gz_job_t job;
+    size_t gzlen;
+    char *gz;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+	P(&items);
+	P(&mutex);
+	job = queue[(++front) % GZ_QUEUESIZE];
+	V(&mutex);
+
+	if ((g = gzcache_sibling(job.e, job.e->path)) != NULL) {
+	    if (!fcache_attach_gz(job.e, g, NULL, 0))
+		fcache_release(g);
+	}
+	else if (job.generate && job.e->st.st_size <= GZ_MAXFILE &&
+		 (gz = compress_file(job.e, &gzlen)) != NULL) {
+	    if (!fcache_attach_gz(job.e, NULL, gz, gzlen))
+		Free(gz);
+	}
+	else
+	    fcache_attach_gz(job.e, NULL, NULL, 0); /* Only marks it GZ_NONE */
+	fcache_release(job.e);
+    }
+    return NULL;
+}
+
+void gzcache_init(void)
+{
+    pthread_t tid;
+
+    front = rear = 0;
+    Sem_init(&mutex, 0, 1);
+    Sem_init(&items, 0, 0);
+    Pthread_create(&tid, NULL, gzip_thread, NULL);
+}
+
+/*
+ * gzcache_queue - have the gzip thread look for (and if generate is
+ *     set, make) a variant of cached entry e, unless that has already
+ *     been done or is underway.  Never blocks: if the queue is full,
+ *     a later request will try again.
+ */
+void gzcache_queue(fcache_entry_t *e, int generate)
+{
+    int unknown = GZ_UNKNOWN;
+
+    if (!__atomic_compare_exchange_n(&e->gz_state, &unknown, GZ_QUEUED, 0,
+				     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	return;
+    P(&mutex);
+    if (rear - front == GZ_QUEUESIZE) {
+	V(&mutex);
+	__atomic_store_n(&e->gz_state, GZ_UNKNOWN, __ATOMIC_RELEASE);
+	return;
+    }
+    fcache_hold(e);
+    queue[(++rear) % GZ_QUEUESIZE].e = e;
+    queue[rear % GZ_QUEUESIZE].generate = generate;
+    V(&mutex);
+    V(&items);
+}
+/* $end gzcachec */
@@ -0,0 +1,10 @@
+#ifndef __GZCACHE_H__
+#define __GZCACHE_H__
+
+#include "fcache.h"
+
+void gzcache_init(void);
+void gzcache_queue(fcache_entry_t *e, int generate);
+fcache_entry_t *gzcache_sibling(fcache_entry_t *e, char *filename);
+
+#endif /* __GZCACHE_H__ */
@@ -1,41 +1,197 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.1 Web server that uses the GET method
+ *     to serve static and dynamic content, including byte ranges of
+ *     static files, over persistent connections.  By default it forks
+ *     a child per connection; "-m thread" serves connections from a
+ *     pool of prethreaded workers fed through an sbuf instead.  Text
+ *     files go out gzip-encoded to clients that accept it, once a
+ *     foo.gz sibling is found or (with "-g auto") one has been made.
  */
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
+#include "sbuf.h"
+#include "fcache.h"
+#include "cgipool.h"
+#include "gzcache.h"
+#define NTHREADS  16
+#define SBUFSIZE  64
+#define CGIWORKERS 4      /* Pooled workers per CGI program (-m thread) */
+#define MAXCACHEDBODY (128 * 1024) /* Keep bodies of smaller files in memory */
+#define MAXREQUESTS 100   /* Requests served on one connection */
+#define IDLETIMEOUT 5     /* Seconds a kept-alive connection may sit idle */
+#define MAXHEADERS 64     /* Request headers kept, the rest are ignored */
+
+/* read_request's errors, besides 0 for a closed connection */
+#define REQ_TOOBIG -1     /* Header block bigger than the RIO buffer */
+#define REQ_BAD    -2     /* No method or URI */
+
+/* $begin request_t */
+typedef struct {
+    char *version;        /* Version we answer with, HTTP/1.0 or 1.1 */
+    int keepalive;        /* Leave the connection open afterwards */
+    int range;            /* Range: bytes=first-last was requested */
+    long long first;      /* -1 for the suffix range "-last" */
+    long long last;       /* -1 for the open range "first-" */
+    int gzip;             /* Accept-Encoding allows gzip */
+} request_t;
+/* $end request_t */
+
+/* $begin reqhdrs_t */
+/* A request's header block, tokenized in place in the RIO buffer */
+typedef struct {
+    char *method;         /* Request line words, "" if missing */
+    char *uri;
+    char *version;
+    int nhdrs;
+    struct {
+	char *name;       /* Without the colon */
+	char *value;      /* Without surrounding blanks */
+    } hdrs[MAXHEADERS];
+} reqhdrs_t;
+/* $end reqhdrs_t */
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int serve_request(int fd, rio_t *rp, int reuse);
+int read_request(rio_t *rp, reqhdrs_t *h);
+int request_buffered(rio_t *rp);
+char *find_blankline(char *buf, size_t len, size_t *scanned);
+char *split_line(char *line, char *end);
+char *next_word(char **p);
+char *trim(char *value);
+void request_header(request_t *req, char *name, char *value);
+int has_token(char *value, char *token);
+int accepts_gzip(char *value);
+void parse_range(char *value, request_t *req);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
-void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
-void clienterror(int fd, char *cause, char *errnum, 
+int serve_static(int fd, request_t *req, char *filename, fcache_entry_t *file);
+int serve_range(int fd, request_t *req, char *filename, fcache_entry_t *file);
+int serve_gzip(int fd, request_t *req, char *filename, fcache_entry_t *file);
+int status_line(char *buf, size_t size, request_t *req, char *status);
+int static_headers(char *buf, size_t size, char *filename, off_t filesize);
+char *cache_response(char *filename, fcache_entry_t *file);
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int sendfile_all(int fd, int srcfd, off_t offset, size_t len);
+const char *get_filetype(char *filename);
+int is_compressible(char *filename);
+void serve_dynamic(int fd, request_t *req, char *filename, char *cgiargs);
+void clienterror(int fd, request_t *req, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
+void *thread(void *vargp);
+
+sbuf_t sbuf; /* Shared buffer of connected descriptors (-m thread) */
+int verbose = 0;      /* -v: print every request and response header */
+#define VERBOSE(...) do { if (verbose) printf(__VA_ARGS__); } while (0)
+int cache_bodies = 1; /* -c mem: keep small files' responses in memory */
+
+/* -g: where gzip variants of text files come from */
+enum { GZIP_NONE, GZIP_STATIC, GZIP_AUTO };
+int gzip_mode = GZIP_AUTO;
+
+void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-m fork|thread] [-t nthreads] [-c none|fd|mem] [-w cgiworkers] [-g none|static|auto] [-l listenopts] [-v] <port>\n", prog);
+    exit(1);
+}
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
+    int i, listenfd, connfd, opt;
+    int threaded = 0, nthreads = NTHREADS, fdcache = 1, cgiworkers = CGIWORKERS;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    listenopts_t opts;
+    pthread_t tid;
+
+    /* Clients speak first, so accept needn't wake until they have */
+    listenopts_init(&opts);
+    opts.defer_accept = 1;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
-	exit(1);
+    while ((opt = getopt(argc, argv, "m:t:c:w:g:l:v")) != -1) {
+	switch (opt) {
+	case 'm':
+	    if (!strcmp(optarg, "thread"))
+		threaded = 1;
+	    else if (strcmp(optarg, "fork"))
+		usage(argv[0]);
+	    break;
+	case 't':
+	    if ((nthreads = atoi(optarg)) <= 0)
+		usage(argv[0]);
+	    break;
+	case 'c':
+	    if (!strcmp(optarg, "none"))
+		fdcache = 0;
+	    else if (!strcmp(optarg, "fd"))
+		cache_bodies = 0;
+	    else if (strcmp(optarg, "mem"))
+		usage(argv[0]);
+	    break;
+	case 'w':
+	    if ((cgiworkers = atoi(optarg)) < 0)
+		usage(argv[0]);
+	    break;
+	case 'g':
+	    if (!strcmp(optarg, "none"))
+		gzip_mode = GZIP_NONE;
+	    else if (!strcmp(optarg, "static"))
+		gzip_mode = GZIP_STATIC;
+	    else if (strcmp(optarg, "auto"))
+		usage(argv[0]);
+	    break;
+	case 'l':
+	    if (listenopts_parse(&opts, optarg) < 0)
+		usage(argv[0]);
+	    break;
+	case 'v':
+	    verbose = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	}
     }
+    if (optind != argc - 1)
+	usage(argv[0]);
 
-    listenfd = Open_listenfd(argv[1]);
+    /* A client that hangs up early must not take the server with it */
+    Signal(SIGPIPE, SIG_IGN);
+    /* Nobody waits for children (connection handlers, CGI programs,
+       pool workers); ignoring SIGCHLD has the kernel reap them */
+    Signal(SIGCHLD, SIG_IGN);
+    listenfd = Open_listenfd_opts(argv[optind], &opts);
+    fcntl(listenfd, F_SETFD, FD_CLOEXEC);
+    /* A forked child's cache would die with it, so only cache in threads */
+    fcache_init(threaded && fdcache);
+    /* Variants hang off cache entries, so they need the cache too */
+    if (threaded && fdcache && gzip_mode != GZIP_NONE)
+	gzcache_init();
+    cgipool_init(threaded ? cgiworkers : 0);
+    if (threaded) {
+	sbuf_init(&sbuf, SBUFSIZE);
+	for (i = 0; i < nthreads; i++)  /* Create worker threads */
+	    Pthread_create(&tid, NULL, thread, NULL);
+    }
     while (1) {
 	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+	if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) //line:netp:tiny:accept
+	    continue; /* e.g. ECONNABORTED or out of descriptors */
+	if (threaded) {
+	    /* Keep other threads' CGI children from inheriting it */
+	    fcntl(connfd, F_SETFD, FD_CLOEXEC);
+	    sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
+	    continue;
+	}
         if (Fork() == 0) { /* Child */ //line:netp:tiny:fork
 	    Close(listenfd);                                            //line:netp:tiny:close
-            Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                        port, MAXLINE, 0);
-            printf("Accepted connection from (%s, %s)\n", hostname, port);
+	    if (verbose) {
+		Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+			    port, MAXLINE, 0);
+		printf("Accepted connection from (%s, %s)\n", hostname, port);
+	    }
 	    doit(connfd);                                             //line:netp:tiny:doit
 	    Close(connfd);                                            //line:netp:tiny:close
 	    exit(0);
@@ -43,77 +199,378 @@ int main(int argc, char **argv)
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
+
+/*
+ * thread - prethreaded worker: serve connections from sbuf forever
+ */
+void *thread(void *vargp) 
+{  
+    Pthread_detach(pthread_self()); 
+    while (1) { 
+	int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
+	doit(connfd);                    /* Service client */
+	Close(connfd);
+    }
+}
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * doit - serve the requests on one connection until either side
+ *     closes it, it sits idle too long, or it has served MAXREQUESTS
  */
 /* $begin doit */
 void doit(int fd) 
 {
-    int is_static;
+    struct timeval idle = { IDLETIMEOUT, 0 };
+    int nreqs = 0, corked = 0, cork, nodelay = 1;
+    rio_t rio;
+
+    /* An idle connection times out inside read_request */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+    /* Headers and body can go out in separate writes; without this,
+       Nagle holds the body back for the client's delayed ACK (~40ms)
+       on every kept-alive request */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    Rio_readinitb(&rio, fd);
+    do {
+	/* While a whole pipelined request is already buffered, cork the
+	   socket so the responses share packets.  Only a whole one: a
+	   partial request makes read_request block for the rest, and
+	   the last response would sit corked (up to 200ms) meanwhile */
+	cork = request_buffered(&rio);
+	if (cork != corked) {
+	    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+	    corked = cork;
+	}
+    } while (serve_request(fd, &rio, ++nreqs < MAXREQUESTS));
+}
+/* $end doit */
+
+/*
+ * request_buffered - returns 1 if rp's buffer holds a complete request
+ *     header block, which read_request can parse without blocking
+ */
+int request_buffered(rio_t *rp)
+{
+    char *p = rp->rio_bufptr, *end = rp->rio_bufptr + rp->rio_cnt;
+    size_t scanned = 0;
+
+    /* Skip the blank lines read_request tolerates between requests */
+    while (p < end && (*p == '\r' || *p == '\n'))
+	p++;
+    return p < end && find_blankline(p, end - p, &scanned) != NULL;
+}
+
+/*
+ * serve_request - handle one HTTP request/response transaction,
+ *     returns 1 if the connection can carry another request
+ */
+/* $begin serve_request */
+int serve_request(int fd, rio_t *rp, int reuse) 
+{
+    int is_static, ok, rc, i;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    fcache_entry_t *file;
+    request_t req;
+    reqhdrs_t h;
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
-        clienterror(fd, method, "501", "Not Implemented",
+    req.version = "HTTP/1.1";
+    req.keepalive = 0;
+    if ((rc = read_request(rp, &h)) == 0)                //line:netp:doit:readrequest
+	return 0;
+    if (rc == REQ_TOOBIG) {
+	clienterror(fd, &req, "request", "431", "Request Header Fields Too Large",
+		    "Tiny couldn't fit the request headers in its buffer");
+	return 0;
+    }
+    if (rc == REQ_BAD || strlen(h.uri) > MAXLINE - sizeof("./home.html")) {
+	clienterror(fd, &req, "request", "400", "Bad Request",
+		    "Tiny couldn't parse the request line");
+	return 0;
+    }
+
+    /* HTTP/1.1 connections persist unless the client says otherwise;
+       HTTP/1.0 ones only if it asks for keep-alive */
+    req.version = strcmp(h.version, "HTTP/1.1") ? "HTTP/1.0" : "HTTP/1.1";
+    req.keepalive = !strcmp(h.version, "HTTP/1.1");
+    req.range = req.gzip = 0;
+    for (i = 0; i < h.nhdrs; i++)                        //line:netp:doit:readrequesthdrs
+	request_header(&req, h.hdrs[i].name, h.hdrs[i].value);
+    req.keepalive = req.keepalive && reuse;
+
+    if (strcasecmp(h.method, "GET")) {                   //line:netp:doit:beginrequesterr
+	req.keepalive = 0; /* We won't read past any request body */
+        clienterror(fd, &req, h.method, "501", "Not Implemented",
                     "Tiny does not implement this method");
-        return;
+        return req.keepalive;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
-    is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
-    if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
-	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
-    }                                                    //line:netp:doit:endnotfound
-
+    is_static = parse_uri(h.uri, filename, cgiargs);       //line:netp:doit:staticcheck
     if (is_static) { /* Serve static content */          
-	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
-	    clienterror(fd, filename, "403", "Forbidden",
+	/* Open (or find already open) fd and stat in one step */
+	if ((file = fcache_open(filename)) == NULL) {    //line:netp:doit:beginnotfound
+	    if (errno == EACCES)
+		clienterror(fd, &req, filename, "403", "Forbidden",
+			    "Tiny couldn't read the file");
+	    else
+		clienterror(fd, &req, filename, "404", "Not found",
+			    "Tiny couldn't find this file");
+	    return req.keepalive;
+	}                                                //line:netp:doit:endnotfound
+	ok = 1;
+	if (!(S_ISREG(file->st.st_mode)) || !(S_IRUSR & file->st.st_mode)) //line:netp:doit:readable
+	    clienterror(fd, &req, filename, "403", "Forbidden",
 			"Tiny couldn't read the file");
-	    return;
-	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	else if (req.range)
+	    ok = serve_range(fd, &req, filename, file) == 0;
+	else if (req.gzip && gzip_mode != GZIP_NONE && is_compressible(filename) &&
+		 (rc = serve_gzip(fd, &req, filename, file)) != 1)
+	    ok = rc == 0;
+	else
+	    ok = serve_static(fd, &req, filename, file) == 0; //line:netp:doit:servestatic
+	fcache_release(file);
+	return ok && req.keepalive;
     }
     else { /* Serve dynamic content */
+	if (stat(filename, &sbuf) < 0) {
+	    clienterror(fd, &req, filename, "404", "Not found",
+			"Tiny couldn't find this file");
+	    return req.keepalive;
+	}
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
-	    clienterror(fd, filename, "403", "Forbidden",
+	    clienterror(fd, &req, filename, "403", "Forbidden",
 			"Tiny couldn't run the CGI program");
-	    return;
+	    return req.keepalive;
 	}
-	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+	serve_dynamic(fd, &req, filename, cgiargs);      //line:netp:doit:servedynamic
+	return 0; /* The CGI output has no length, so it ends at close */
     }
 }
-/* $end doit */
+/* $end serve_request */
+
+/*
+ * read_request - read a request's header block into rp's buffer and
+ *     tokenize it there: no per-line copies, the blank line that ends
+ *     the block is found with memchr, and h gets pointers to the
+ *     request line's words and each header's name and value, good
+ *     until the next read_request.  Anything after the block (a
+ *     pipelined request) stays buffered.  Returns 1 on success, 0 if
+ *     the client hung up or went idle, REQ_TOOBIG if the block doesn't
+ *     fit in RIO_BUFSIZE, or REQ_BAD if there is no method and URI.
+ */
+/* $begin read_request */
+int read_request(rio_t *rp, reqhdrs_t *h) 
+{
+    char *block, *end, *line, *next, *colon;
+    size_t scanned = 0;
+    ssize_t n;
+
+    while (1) {
+	/* Tolerate blank lines between requests */
+	while (rp->rio_cnt > 0 &&
+	       (*rp->rio_bufptr == '\r' || *rp->rio_bufptr == '\n')) {
+	    rp->rio_bufptr++;
+	    rp->rio_cnt--;
+	}
+	if ((end = find_blankline(rp->rio_bufptr, rp->rio_cnt, &scanned)) != NULL)
+	    break;
+	/* Slide the partial block to the front and read more after it */
+	if (rp->rio_bufptr != rp->rio_buf) {
+	    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+	    rp->rio_bufptr = rp->rio_buf;
+	}
+	if (rp->rio_cnt == RIO_BUFSIZE)
+	    return REQ_TOOBIG;
+	n = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, RIO_BUFSIZE - rp->rio_cnt);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)   /* EOF, error, or SO_RCVTIMEO ran out */
+	    return 0;
+	rp->rio_cnt += n;
+    }
+    block = rp->rio_bufptr;
+    rp->rio_bufptr = end;
+    rp->rio_cnt -= end - block;
+    VERBOSE("%.*s", (int)(end - block), block);
+
+    /* Request line: method, URI and (optionally) version */
+    line = block;
+    next = split_line(line, end);
+    h->method = next_word(&line);
+    h->uri = next_word(&line);
+    h->version = next_word(&line);
+    if (*h->method == '\0' || *h->uri == '\0')
+	return REQ_BAD;
+
+    /* Header lines, up to the blank one */
+    h->nhdrs = 0;
+    for (line = next; line < end; line = next) {
+	next = split_line(line, end);
+	if (*line == '\0')
+	    break;
+	if ((colon = strchr(line, ':')) == NULL || h->nhdrs == MAXHEADERS)
+	    continue;
+	*colon = '\0';
+	h->hdrs[h->nhdrs].name = line;
+	h->hdrs[h->nhdrs].value = trim(colon + 1);
+	h->nhdrs++;
+    }
+    return 1;
+}
+/* $end read_request */
+
+/*
+ * find_blankline - return the end of the first header block in
+ *     buf[0..len), i.e. just past its blank line ("\r\n" or a bare
+ *     "\n"), or NULL if it isn't all there yet.  *scanned carries
+ *     how far earlier calls got, so each byte is only looked at once.
+ */
+char *find_blankline(char *buf, size_t len, size_t *scanned)
+{
+    char *p = buf + *scanned, *end = buf + len, *nl;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL) {
+	if (end - nl >= 2 && nl[1] == '\n')
+	    return nl + 2;
+	if (end - nl >= 3 && nl[1] == '\r' && nl[2] == '\n')
+	    return nl + 3;
+	if (end - nl < 3 && (end - nl == 1 || nl[1] == '\r')) {
+	    *scanned = nl - buf;   /* Can't tell yet, look again later */
+	    return NULL;
+	}
+	p = nl + 1;
+    }
+    *scanned = len;
+    return NULL;
+}
+
+/* NUL-terminate the line at line (a newline comes before end); return the next */
+char *split_line(char *line, char *end)
+{
+    char *nl = memchr(line, '\n', end - line);
+
+    *nl = '\0';
+    if (nl > line && nl[-1] == '\r')
+	nl[-1] = '\0';
+    return nl + 1;
+}
+
+/* NUL-terminate the next space-separated word at *p and step past it */
+char *next_word(char **p)
+{
+    char *word = *p + strspn(*p, " \t");
+
+    *p = word + strcspn(word, " \t");
+    if (**p != '\0')
+	*(*p)++ = '\0';
+    return word;
+}
+
+/* Strip leading and trailing blanks off a header value, in place */
+char *trim(char *value)
+{
+    char *end;
+
+    value += strspn(value, " \t");
+    end = value + strlen(value);
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+	end--;
+    *end = '\0';
+    return value;
+}
+
+/*
+ * request_header - note a request header that tiny acts on
+ */
+void request_header(request_t *req, char *name, char *value)
+{
+    if (!strcasecmp(name, "Connection")) {
+	if (has_token(value, "close"))
+	    req->keepalive = 0;
+	else if (has_token(value, "keep-alive"))
+	    req->keepalive = 1;
+    }
+    else if (!strcasecmp(name, "Range"))
+	parse_range(value, req);
+    else if (!strcasecmp(name, "Accept-Encoding"))
+	req->gzip = accepts_gzip(value);
+}
+
+/*
+ * has_token - does a comma-separated header value list token?
+ */
+int has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+
+    while (*value) {
+	value += strspn(value, " \t,");
+	if (!strncasecmp(value, token, len) && strchr(" \t,\r\n", value[len]))
+	    return 1;
+	value += strcspn(value, ",");
+    }
+    return 0;
+}
+
+/*
+ * accepts_gzip - does an Accept-Encoding value list gzip, other
+ *     than with q=0?
+ */
+int accepts_gzip(char *value)
+{
+    char *end;
+
+    while (*value) {
+	value += strspn(value, " \t,");
+	end = value + strcspn(value, ",");
+	if (!strncasecmp(value, "gzip", 4) && strchr(" \t;,\r\n", value[4])) {
+	    /* Look for a q parameter before the next coding */
+	    for (value += 4; value < end; value++)
+		if (!strncasecmp(value, "q=", 2))
+		    return strtod(value + 2, NULL) > 0;
+	    return 1;
+	}
+	value = end;
+    }
+    return 0;
+}
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * parse_range - parse a single "bytes=first-last", "bytes=first-" or
+ *     "bytes=-suffix" range; anything else (e.g. several ranges) is
+ *     ignored and the whole file is sent
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+void parse_range(char *value, request_t *req)
 {
-    char buf[MAXLINE];
+    char *p = value + strspn(value, " \t"), *end;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    if (strncasecmp(p, "bytes=", 6))
+	return;
+    p += 6;
+    if (*p == '-') {
+	req->first = -1;
+	req->last = strtoll(p + 1, &end, 10);
+	if (end == p + 1)
+	    return;
     }
-    return;
+    else {
+	req->first = strtoll(p, &end, 10);
+	if (end == p || *end != '-')
+	    return;
+	p = end + 1;
+	req->last = strtoll(p, &end, 10);
+	if (end == p)
+	    req->last = -1;
+	else if (req->last < req->first)
+	    return;
+    }
+    if (req->first < -1 || req->last < -1 || end[strspn(end, " \t")] != '\0')
+	return;
+    req->range = 1;
 }
-/* $end read_requesthdrs */
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -145,72 +602,334 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - send a file back to the client: the status line,
+ *     then the cached headers (and body) in the same writev when
+ *     there are some, else headers and then sendfile, so the body
+ *     never passes through user space.  Returns -1 on a write error.
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+int serve_static(int fd, request_t *req, char *filename, fcache_entry_t *file) 
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
- 
+    off_t filesize = file->st.st_size;
+    char buf[MAXBUF], *resp;
+    struct iovec iov[2];
+    int len;
+
+    len = status_line(buf, sizeof(buf), req, "200 OK"); //line:netp:servestatic:beginserve
+    resp = __atomic_load_n(&file->resp, __ATOMIC_ACQUIRE);
+    if (resp == NULL && file->cached)
+	resp = cache_response(filename, file);
+    if (resp) {
+	iov[0].iov_base = buf;
+	iov[0].iov_len = len;
+	iov[1].iov_base = resp;
+	iov[1].iov_len = file->resplen;
+	if (writev_all(fd, iov, 2) < 0)
+	    return -1;
+	VERBOSE("Response headers:\n%s%.*s", buf, (int)file->hdrlen, resp);
+	if (file->resplen > file->hdrlen)
+	    return 0;
+	/* Headers only, the body was too big to keep */
+	return sendfile_all(fd, file->fd, 0, filesize);
+    }
+
     /* Send response headers to client */
-    get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
-    printf("Response headers:\n");
-    printf("%s", buf);
+    len += static_headers(buf + len, sizeof(buf) - len, filename, filesize);
+    if (rio_writen(fd, buf, len) != len)    //line:netp:servestatic:endserve
+	return -1;
+    VERBOSE("Response headers:\n%s", buf);
 
     /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);    //line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);//line:netp:servestatic:mmap
-    Close(srcfd);                           //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);         //line:netp:servestatic:write
-    Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
+    return sendfile_all(fd, file->fd, 0, filesize); //line:netp:servestatic:write
 }
 
 /*
- * get_filetype - derive file type from file name
+ * serve_range - send the requested byte range of a file (206), or
+ *     416 if it starts past the end.  Returns -1 on a write error.
  */
-void get_filetype(char *filename, char *filetype) 
+int serve_range(int fd, request_t *req, char *filename, fcache_entry_t *file) 
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
+    long long filesize = file->st.st_size, first = req->first, last = req->last;
+    char buf[MAXBUF];
+    int len;
+
+    if (first == -1) {             /* The last "last" bytes */
+	first = last < filesize ? filesize - last : 0;
+	last = filesize - 1;
+    }
+    else if (last == -1 || last >= filesize)
+	last = filesize - 1;
+    if (first >= filesize || first > last) {
+	len = status_line(buf, sizeof(buf), req, "416 Range Not Satisfiable");
+	len += snprintf(buf + len, sizeof(buf) - len,
+			"Server: Tiny Web Server\r\n"
+			"Content-Range: bytes */%lld\r\n"
+			"Content-length: 0\r\n\r\n", filesize);
+	VERBOSE("Response headers:\n%s", buf);
+	return rio_writen(fd, buf, len) == len ? 0 : -1;
+    }
+
+    len = status_line(buf, sizeof(buf), req, "206 Partial Content");
+    len += snprintf(buf + len, sizeof(buf) - len,
+		    "Server: Tiny Web Server\r\n"
+		    "Accept-Ranges: bytes\r\n"
+		    "Content-Range: bytes %lld-%lld/%lld\r\n"
+		    "Content-length: %lld\r\n"
+		    "Content-type: %s\r\n\r\n",
+		    first, last, filesize, last - first + 1, get_filetype(filename));
+    if (rio_writen(fd, buf, len) != len)
+	return -1;
+    VERBOSE("Response headers:\n%s", buf);
+
+    /* Stream just the range from the file */
+    return sendfile_all(fd, file->fd, first, last - first + 1);
+}
+
+/*
+ * serve_gzip - send the gzip variant of a text file (200, with
+ *     Content-Encoding: gzip).  A cached file's variant is found or
+ *     made in the background, so the first requests for it get 1
+ *     back and the caller sends the file as is; an uncached file's
+ *     foo.gz sibling is looked for on every request.  Returns -1 on
+ *     a write error.
+ */
+int serve_gzip(int fd, request_t *req, char *filename, fcache_entry_t *file)
+{
+    fcache_entry_t *g = NULL;
+    char buf[MAXBUF];
+    struct iovec iov[2];
+    long long gzlen;
+    int len, rc;
+
+    if (file->cached) {
+	if (__atomic_load_n(&file->gz_state, __ATOMIC_ACQUIRE) != GZ_READY) {
+	    gzcache_queue(file, gzip_mode == GZIP_AUTO);
+	    return 1;
+	}
+	gzlen = file->gz ? file->gzlen : file->gz_file->st.st_size;
+    }
+    else {
+	if ((g = gzcache_sibling(file, filename)) == NULL)
+	    return 1;
+	gzlen = g->st.st_size;
+    }
+
+    len = status_line(buf, sizeof(buf), req, "200 OK");
+    len += snprintf(buf + len, sizeof(buf) - len,
+		    "Server: Tiny Web Server\r\n"
+		    "Content-Encoding: gzip\r\n"
+		    "Vary: Accept-Encoding\r\n"
+		    "Content-length: %lld\r\n"
+		    "Content-type: %s\r\n\r\n",
+		    gzlen, get_filetype(filename));
+    VERBOSE("Response headers:\n%s", buf);
+    if (g == NULL && file->gz) {
+	iov[0].iov_base = buf;
+	iov[0].iov_len = len;
+	iov[1].iov_base = file->gz;
+	iov[1].iov_len = gzlen;
+	return writev_all(fd, iov, 2);
+    }
+    if (rio_writen(fd, buf, len) != len)
+	rc = -1;
     else
-	strcpy(filetype, "text/plain");
+	rc = sendfile_all(fd, (g ? g : file->gz_file)->fd, 0, gzlen);
+    if (g)
+	fcache_release(g);
+    return rc;
+}
+
+/*
+ * status_line - format the status line and Connection header
+ */
+int status_line(char *buf, size_t size, request_t *req, char *status)
+{
+    return snprintf(buf, size, "%s %s\r\nConnection: %s\r\n",
+		    req->version, status, req->keepalive ? "keep-alive" : "close");
+}
+
+/*
+ * static_headers - format the rest of the response headers for a
+ *     static file; they don't depend on the request, so can be cached
+ */
+int static_headers(char *buf, size_t size, char *filename, off_t filesize)
+{
+    /* Caches must keep identity and gzip responses apart */
+    int vary = gzip_mode != GZIP_NONE && is_compressible(filename);
+
+    return snprintf(buf, size,
+		    "Server: Tiny Web Server\r\n"
+		    "Accept-Ranges: bytes\r\n"
+		    "%s"
+		    "Content-length: %lld\r\n"
+		    "Content-type: %s\r\n\r\n",
+		    vary ? "Vary: Accept-Encoding\r\n" : "",
+		    (long long)filesize, get_filetype(filename));
+}
+
+/*
+ * cache_response - build the headers for a cached file, followed by
+ *     its body if it is small, and attach them to the cache entry.
+ *     Returns the attached response, or NULL to serve it uncached.
+ */
+char *cache_response(char *filename, fcache_entry_t *file)
+{
+    off_t filesize = file->st.st_size;
+    size_t bodylen = (cache_bodies && filesize <= MAXCACHEDBODY) ? filesize : 0;
+    char hdr[MAXLINE], *resp;
+    size_t nread = 0;
+    ssize_t n;
+    int hdrlen;
+
+    hdrlen = static_headers(hdr, sizeof(hdr), filename, filesize);
+    resp = Malloc(hdrlen + bodylen);
+    memcpy(resp, hdr, hdrlen);
+    while (nread < bodylen) {
+	if ((n = pread(file->fd, resp + hdrlen + nread, bodylen - nread, nread)) <= 0) {
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    Free(resp);     /* Changed under us; inotify will drop it */
+	    return NULL;
+	}
+	nread += n;
+    }
+    if (!fcache_attach(file, resp, hdrlen, hdrlen + bodylen)) {
+	Free(resp);
+	return __atomic_load_n(&file->resp, __ATOMIC_ACQUIRE); /* Another thread's */
+    }
+    return resp;
+}
+
+/*
+ * writev_all - write every byte described by iov, resuming after
+ *     short writes; the iovecs are modified
+ */
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+	if ((n = writev(fd, iov, iovcnt)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+	    n -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {
+	    iov->iov_base = (char *)iov->iov_base + n;
+	    iov->iov_len -= n;
+	}
+    }
+    return 0;
+}
+
+/*
+ * sendfile_all - send len bytes of srcfd from offset without moving
+ *     its file position (the descriptor may be shared between threads)
+ */
+int sendfile_all(int fd, int srcfd, off_t offset, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	if ((n = sendfile(fd, srcfd, &offset, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0)
+	    return -1;          /* File shrank after we sent the length */
+	len -= n;
+    }
+    return 0;
+}
+
+/*
+ * get_filetype - derive file type from the file name's extension
+ */
+static const struct {
+    const char *ext;
+    const char *type;
+    int compress;         /* Text, worth sending gzip-encoded */
+} filetypes[] = {
+    { "html", "text/html",              1 },
+    { "htm",  "text/html",              1 },
+    { "gif",  "image/gif",              0 },
+    { "png",  "image/png",              0 },
+    { "jpg",  "image/jpeg",             0 },
+    { "jpeg", "image/jpeg",             0 },
+    { "css",  "text/css",               1 },
+    { "js",   "application/javascript", 1 },
+    { "json", "application/json",       1 },
+    { "ico",  "image/x-icon",           0 },
+    { "svg",  "image/svg+xml",          1 },
+    { "pdf",  "application/pdf",        0 },
+    { "gz",   "application/gzip",       0 },
+};
+
+/* Index of filename's entry in filetypes, -1 for text/plain */
+static int filetype_index(char *filename)
+{
+    char *ext = strrchr(filename, '.');
+    int i;
+
+    if (ext && !strchr(ext, '/')) {
+	for (i = 0; i < sizeof(filetypes) / sizeof(filetypes[0]); i++)
+	    if (!strcasecmp(ext + 1, filetypes[i].ext))
+		return i;
+    }
+    return -1;
+}
+
+const char *get_filetype(char *filename) 
+{
+    int i = filetype_index(filename);
+
+    return i < 0 ? "text/plain" : filetypes[i].type;
 }  
+
+/*
+ * is_compressible - is filename text, so worth a gzip variant?
+ */
+int is_compressible(char *filename)
+{
+    int i = filetype_index(filename);
+
+    return i < 0 || filetypes[i].compress;
+}
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client, in a
+ *     pooled worker if it has one; either way, without waiting for it
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+void serve_dynamic(int fd, request_t *req, char *filename, char *cgiargs) 
 {
     char buf[MAXLINE], *emptylist[] = { NULL };
+    int len;
 
     /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
+    req->keepalive = 0;
+    len = status_line(buf, sizeof(buf), req, "200 OK");
+    len += snprintf(buf + len, sizeof(buf) - len, "Server: Tiny Web Server\r\n");
+    rio_writen(fd, buf, len);
+
+    if (cgipool_run(filename, cgiargs, fd) == 0)
+	return;
     if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
+	Signal(SIGCHLD, SIG_DFL);
+	Signal(SIGPIPE, SIG_DFL);
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
 	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
-    Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    /* The child holds its own copy of fd and the kernel reaps it */
 }
 /* $end serve_dynamic */
 
@@ -218,25 +937,32 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  * clienterror - returns an error message to the client
  */
 /* $begin clienterror */
-void clienterror(int fd, char *cause, char *errnum, 
+void clienterror(int fd, request_t *req, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
     char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov[2];
+    int len;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    snprintf(body, sizeof(body),
+	     "<html><title>Tiny Error</title>"
+	     "<body bgcolor=""ffffff"">\r\n"
+	     "%s: %s\r\n"
+	     "<p>%s: %s\r\n"
+	     "<hr><em>The Tiny Web server</em>\r\n",
+	     errnum, shortmsg, longmsg, cause);
 
     /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    len = snprintf(buf, sizeof(buf), "%s %s %s\r\nConnection: %s\r\n",
+		   req->version, errnum, shortmsg, req->keepalive ? "keep-alive" : "close");
+    len += snprintf(buf + len, sizeof(buf) - len,
+		    "Content-type: text/html\r\n"
+		    "Content-length: %d\r\n\r\n", (int)strlen(body));
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    writev_all(fd, iov, 2);
 }
 /* $end clienterror */